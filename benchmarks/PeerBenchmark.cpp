@@ -0,0 +1,210 @@
+
+// Measures end to end latency and throughput between a pair of peers on this host (through the full peer send / receive paths)
+// The client sends timestamped messages at a fixed rate, which the server records and echoes back to all clients
+// Build alongside iPlug2 (for IPlugStructs.h / IPlugLogger.h) and the dependencies with the include directory on the path, e.g.
+// c++ -std=c++17 -O2 -I../include -I<iPlug2>/IPlug -I<iPlug2>/WDL PeerBenchmark.cpp -pthread
+// Usage: PeerBenchmark [websocket | local] [messages per second] [seconds per size] [port]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "NetworkPeer.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static uint64_t Now()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count());
+}
+
+// A peer that records one way latency as a server and round trip latency as a client
+
+class BenchPeer : public NetworkPeer
+{
+public:
+    
+    BenchPeer(const char* regname, uint16_t port)
+    : NetworkPeer(regname, port, DiscoveryMode::Beacon)
+    {
+        // N.B. the pair must find each other over loopback (not dial a server stored by a previous run)
+        
+        SetLastServerPath("");
+        SetBeaconInterface("127.0.0.1");
+    }
+    
+    // N.B. this should only be called whilst no messages are in flight
+    
+    void Reset(int size)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        std::vector<uint8_t> payload(size, 0x5A);
+        
+        mPayload.Clear();
+        mPayload.PutBytes(payload.data(), size);
+        mSize = size;
+        mOneWay.clear();
+        mRoundTrip.clear();
+    }
+    
+    void Send(uint64_t sequence)
+    {
+        SendFromClient(sequence, Now(), mSize, mPayload);
+    }
+    
+    size_t NumRoundTrips()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        return mRoundTrip.size();
+    }
+    
+    std::vector<double> OneWay()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        return mOneWay;
+    }
+    
+    std::vector<double> RoundTrip()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        return mRoundTrip;
+    }
+    
+private:
+    
+    void ReceiveAsServer(ConnectionID id, NetworkByteStream& data) override
+    {
+        uint64_t sequence = 0;
+        uint64_t sent = 0;
+        int size = 0;
+        
+        data.Get(sequence, sent, size);
+        
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mOneWay.push_back((Now() - sent) / 1000.0);
+        }
+        
+        SendFromServer(sequence, sent, size, mPayload);
+    }
+    
+    void ReceiveAsClient(NetworkByteStream& data) override
+    {
+        uint64_t sequence = 0;
+        uint64_t sent = 0;
+        
+        data.Get(sequence, sent);
+        
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRoundTrip.push_back((Now() - sent) / 1000.0);
+    }
+    
+    std::mutex mMutex;
+    iplug::IByteChunk mPayload;
+    int mSize = 0;
+    std::vector<double> mOneWay;
+    std::vector<double> mRoundTrip;
+};
+
+static double Percentile(std::vector<double> times, double percentile)
+{
+    if (times.empty())
+        return 0.0;
+    
+    std::sort(times.begin(), times.end());
+    
+    return times[std::min(times.size() - 1, static_cast<size_t>(times.size() * percentile / 100.0))];
+}
+
+int main(int argc, const char* argv[])
+{
+    const bool local = argc > 1 && !strcmp(argv[1], "local");
+    const double rate = argc > 2 ? atof(argv[2]) : 1000.0;
+    const double seconds = argc > 3 ? atof(argv[3]) : 2.0;
+    const uint16_t port = argc > 4 ? static_cast<uint16_t>(atoi(argv[4])) : 8201;
+    
+    // Large messages are sent at a lower rate to keep loopback bandwidth bounded
+    
+    const double maxBytesPerSecond = 256.0 * 1024.0 * 1024.0;
+    const int sizes[] = { 16, 256, 4096, 65536, 1048576 };
+    
+    BenchPeer peer1("PeerBenchmark", port);
+    BenchPeer peer2("PeerBenchmark", port);
+    
+    peer1.SetLocalTransport(local);
+    peer2.SetLocalTransport(local);
+    
+    // N.B. the handles are declared after the peers (so that driving stops before either peer is destroyed)
+    
+    NetworkHub::Driver driver1 = peer1.StartSharedDiscovery(250);
+    NetworkHub::Driver driver2 = peer2.StartSharedDiscovery(250);
+    
+    // Wait for the pair to elect a server
+    
+    auto deadline = Clock::now() + std::chrono::seconds(10);
+    
+    while (Clock::now() < deadline && !(peer1.IsConnectedAsServer() && peer2.IsConnectedAsClient()) && !(peer2.IsConnectedAsServer() && peer1.IsConnectedAsClient()))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    
+    if (peer1.IsDisconnected() || peer2.IsDisconnected())
+    {
+        printf("peers did not connect\n");
+        return 1;
+    }
+    
+    BenchPeer& server = peer1.IsConnectedAsServer() ? peer1 : peer2;
+    BenchPeer& client = peer1.IsConnectedAsServer() ? peer2 : peer1;
+    
+    printf("transport: %s\n", local ? "local" : "websocket");
+    printf("%8s %8s %10s %9s %10s %10s %10s %10s %9s %6s\n", "bytes", "rate", "msgs/s", "MB/s", "1way p50", "1way p99", "rtt p50", "rtt p99", "cpu(us)", "lost");
+    
+    for (int size : sizes)
+    {
+        const double sizeRate = std::min(rate, maxBytesPerSecond / size);
+        const uint64_t count = std::max<uint64_t>(1, static_cast<uint64_t>(sizeRate * seconds));
+        
+        server.Reset(size);
+        client.Reset(size);
+        
+        std::clock_t cpu = std::clock();
+        auto start = Clock::now();
+        
+        // Messages are paced against the start time (so that slow sends do not lower the offered rate)
+        
+        for (uint64_t i = 0; i < count; i++)
+        {
+            std::this_thread::sleep_until(start + std::chrono::duration<double>(i / sizeRate));
+            client.Send(i);
+        }
+        
+        auto drain = Clock::now() + std::chrono::seconds(2);
+        
+        while (client.NumRoundTrips() < count && Clock::now() < drain)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        
+        const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        const double cpuTime = static_cast<double>(std::clock() - cpu) / CLOCKS_PER_SEC;
+        
+        std::vector<double> oneWay = server.OneWay();
+        std::vector<double> roundTrip = client.RoundTrip();
+        
+        const double received = static_cast<double>(std::max<size_t>(1, oneWay.size()));
+        
+        printf("%8d %8.0f %10.0f %9.2f %10.1f %10.1f %10.1f %10.1f %9.2f %6llu\n",
+               size, sizeRate, oneWay.size() / elapsed, oneWay.size() * static_cast<double>(size) / elapsed / 1e6,
+               Percentile(oneWay, 50), Percentile(oneWay, 99), Percentile(roundTrip, 50), Percentile(roundTrip, 99),
+               1e6 * cpuTime / received, static_cast<unsigned long long>(count - std::min<uint64_t>(count, roundTrip.size())));
+    }
+    
+    return 0;
+}
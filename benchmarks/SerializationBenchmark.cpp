@@ -0,0 +1,183 @@
+
+// Measures the encode and decode cost of NetworkByteChunk and NetworkByteStream (time and heap allocations per operation)
+// Build alongside iPlug2 (for IPlugStructs.h / IPlugLogger.h) with the include directory on the path, e.g.
+// c++ -std=c++17 -O2 -I../include -I<iPlug2>/IPlug -I<iPlug2>/WDL SerializationBenchmark.cpp
+// Usage: SerializationBenchmark [iterations]
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "NetworkData.hpp"
+
+// Every heap allocation in the process is counted
+
+static std::atomic<uint64_t> sAllocations { 0 };
+
+void* operator new(size_t size)
+{
+    sAllocations.fetch_add(1, std::memory_order_relaxed);
+    
+    if (void* ptr = malloc(size ? size : 1))
+        return ptr;
+    
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept
+{
+    free(ptr);
+}
+
+// Results are accumulated here so that the operations are not optimised away
+
+static volatile uint64_t sSink = 0;
+
+template <class Op>
+void Measure(const char* name, int count, Op op)
+{
+    using Clock = std::chrono::steady_clock;
+    
+    // Warm up before timing
+    
+    for (int i = 0; i < count / 10; i++)
+        op();
+    
+    uint64_t allocations = sAllocations.load();
+    auto start = Clock::now();
+    
+    for (int i = 0; i < count; i++)
+        op();
+    
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    double allocated = static_cast<double>(sAllocations.load() - allocations);
+    
+    printf("%-28s %10.1f %10.2f\n", name, ns / count, allocated / count);
+}
+
+// A peer list chunk as built by SendPeerList()
+
+NetworkByteChunk HostsChunk(int size)
+{
+    NetworkByteChunk chunk(size);
+    WDL_String name("studio-mac.local.");
+    
+    for (int i = 0; i < size; i++)
+        chunk.Add(static_cast<uint64_t>(0x9E3779B97F4A7C15ULL * (i + 1)), name, static_cast<uint16_t>(8001 + i), static_cast<uint32_t>(i * 1500));
+    
+    return chunk;
+}
+
+int main(int argc, const char* argv[])
+{
+    const int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    
+    const WDL_String host("studio-mac.local.");
+    const uint64_t id = 0x0123456789ABCDEFULL;
+    const uint16_t port = 8001;
+    
+    printf("%-28s %10s %10s\n", "operation", "ns/op", "allocs/op");
+    
+    // Encoding
+    
+    Measure("chunk mixed args", count, [&]()
+    {
+        NetworkByteChunk chunk("~", "Negotiate", id, host, port, 3);
+        sSink = sSink + chunk.Size();
+    });
+    
+    // Repeated strings are sent as references after their first use
+    
+    NetworkDictionary::Encoder encoder;
+    
+    Measure("chunk dictionary args", count, [&]()
+    {
+        NetworkByteChunk chunk(encoder, "~", "Negotiate", id, host, port, 3);
+        sSink = sSink + chunk.Size();
+    });
+    
+    Measure("chunk nested (8 hosts)", count / 10, [&]()
+    {
+        NetworkByteChunk hosts = HostsChunk(8);
+        NetworkByteChunk chunk("~", "Hosts", hosts);
+        sSink = sSink + chunk.Size();
+    });
+    
+    // Decoding
+    
+    NetworkByteChunk scalars(id, port, 3, 1500u);
+    NetworkByteChunk strings(host, "studio-pc.local.");
+    NetworkByteChunk tagged("~", "Confirm", 1, id);
+    
+    iplug::IByteStream scalarStream(scalars.GetData(), scalars.Size());
+    iplug::IByteStream stringStream(strings.GetData(), strings.Size());
+    iplug::IByteStream taggedStream(tagged.GetData(), tagged.Size());
+    
+    // The decoder is primed with the definitions so that the measured stream only holds references
+    
+    NetworkDictionary::Encoder stringEncoder;
+    NetworkDictionary::Decoder decoder;
+    NetworkByteChunk definitions(stringEncoder, host, "studio-pc.local.");
+    NetworkByteChunk references(stringEncoder, host, "studio-pc.local.");
+    
+    iplug::IByteStream definitionStream(definitions.GetData(), definitions.Size());
+    iplug::IByteStream referenceStream(references.GetData(), references.Size());
+    
+    {
+        NetworkByteStream stream(definitionStream, 0, &decoder);
+        
+        stream.ReadDefinitions();
+    }
+    
+    Measure("stream get scalars (x4)", count, [&]()
+    {
+        NetworkByteStream stream(scalarStream);
+        uint64_t a = 0;
+        uint16_t b = 0;
+        int c = 0;
+        uint32_t d = 0;
+        
+        stream.Get(a, b, c, d);
+        sSink = sSink + a + b + c + d;
+    });
+    
+    Measure("stream get strings (x2)", count, [&]()
+    {
+        NetworkByteStream stream(stringStream);
+        WDL_String a, b;
+        
+        stream.Get(a, b);
+        sSink = sSink + a.GetLength() + b.GetLength();
+    });
+    
+    Measure("stream get references (x2)", count, [&]()
+    {
+        NetworkByteStream stream(referenceStream, 0, &decoder);
+        WDL_String a, b;
+        
+        stream.Get(a, b);
+        sSink = sSink + a.GetLength() + b.GetLength();
+    });
+    
+    Measure("IsNextTag hit", count, [&]()
+    {
+        NetworkByteStream stream(taggedStream);
+        sSink = sSink + stream.IsNextTag("~") + stream.IsNextTag("Confirm");
+    });
+    
+    Measure("IsNextTag miss", count, [&]()
+    {
+        NetworkByteStream stream(taggedStream);
+        sSink = sSink + stream.IsNextTag("-") + stream.IsNextTag("Negotiate");
+    });
+    
+    return 0;
+}
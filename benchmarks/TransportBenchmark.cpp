@@ -0,0 +1,164 @@
+
+// Compares round trip latency and CPU cost for same-host peers over the websocket and the local transport
+// Build alongside iPlug2 (for IPlugStructs.h / IPlugLogger.h) with the include directory on the path, e.g.
+// c++ -std=c++17 -O2 -I../include -I<iPlug2>/IPlug -I<iPlug2>/WDL TransportBenchmark.cpp -pthread
+// Usage: TransportBenchmark [port] [round trips]
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "NetworkClient.hpp"
+#include "NetworkServer.hpp"
+
+// A server that echoes every message to the sender
+
+class EchoServer : public NetworkServer
+{
+public:
+    
+    ~EchoServer()
+    {
+        StopServer();
+    }
+    
+private:
+    
+    void OnDataToServer(ConnectionID id, const iplug::IByteStream& data) override
+    {
+        iplug::IByteChunk chunk;
+        
+        chunk.PutBytes(data.GetData(), data.Size());
+        SendDataToClient(id, chunk);
+    }
+};
+
+// A client that waits for each echo in turn
+
+class EchoClient : public NetworkClient
+{
+public:
+    
+    ~EchoClient()
+    {
+        Disconnect();
+    }
+    
+    bool RoundTrip(const iplug::IByteChunk& chunk)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        
+        uint64_t count = mCount;
+        
+        SendDataFromClient(chunk);
+        
+        return mCondition.wait_for(lock, std::chrono::seconds(2), [&]() { return mCount != count; });
+    }
+    
+private:
+    
+    void OnDataToClient(const iplug::IByteStream& data) override
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        mCount++;
+        mCondition.notify_one();
+    }
+    
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    uint64_t mCount = 0;
+};
+
+struct Result
+{
+    double mMean = 0.0;
+    double mMedian = 0.0;
+    double mP99 = 0.0;
+    double mCPU = 0.0;
+    int mFailures = 0;
+};
+
+Result Measure(EchoClient& client, int size, int count)
+{
+    using Clock = std::chrono::steady_clock;
+    
+    std::vector<double> times;
+    std::vector<uint8_t> payload(size, 0x5A);
+    iplug::IByteChunk chunk;
+    Result result;
+    
+    chunk.PutBytes(payload.data(), size);
+    times.reserve(count);
+    
+    // Warm up before timing
+    
+    for (int i = 0; i < 100; i++)
+        client.RoundTrip(chunk);
+    
+    std::clock_t cpu = std::clock();
+    
+    for (int i = 0; i < count; i++)
+    {
+        auto start = Clock::now();
+        
+        if (!client.RoundTrip(chunk))
+            result.mFailures++;
+        
+        times.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+    
+    result.mCPU = 1000000.0 * (std::clock() - cpu) / CLOCKS_PER_SEC / count;
+    
+    std::sort(times.begin(), times.end());
+    
+    for (auto it = times.begin(); it != times.end(); it++)
+        result.mMean += *it / count;
+    
+    result.mMedian = times[count / 2];
+    result.mP99 = times[(count * 99) / 100];
+    
+    return result;
+}
+
+int main(int argc, const char* argv[])
+{
+    const uint16_t port = argc > 1 ? static_cast<uint16_t>(atoi(argv[1])) : 8101;
+    const int count = argc > 2 ? atoi(argv[2]) : 10000;
+    const int sizes[] = { 16, 256, 4096, 65536 };
+    
+    EchoServer server;
+    
+    server.StartServer(port);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    
+    printf("%-10s %8s %10s %10s %10s %10s %8s\n", "transport", "bytes", "mean(us)", "p50(us)", "p99(us)", "cpu(us)", "failed");
+    
+    for (int local = 0; local < 2; local++)
+    {
+        EchoClient client;
+        
+        client.SetLocalTransport(local);
+        
+        if (!client.Connect("127.0.0.1", port))
+        {
+            printf("%-10s could not connect\n", local ? "local" : "websocket");
+            continue;
+        }
+        
+        for (int size : sizes)
+        {
+            Result result = Measure(client, size, count);
+            
+            printf("%-10s %8d %10.2f %10.2f %10.2f %10.2f %8d\n", local ? "local" : "websocket", size, result.mMean, result.mMedian, result.mP99, result.mCPU, result.mFailures);
+        }
+    }
+    
+    return 0;
+}
@@ -0,0 +1,88 @@
+
+#ifndef ATOMICSNAPSHOT_HPP
+#define ATOMICSNAPSHOT_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <utility>
+
+// An immutable value published by a single writer that any number of readers can load without locking
+// Readers register in the current epoch while they take a reference (retrying only if a writer moves on)
+// Writers swap in a new value and wait for readers of the previous epoch before reclaiming the old one
+// N.B. calls to Store() must be serialised by the caller
+
+template <class T>
+class AtomicSnapshot
+{
+    struct Node
+    {
+        std::shared_ptr<const T> mValue;
+    };
+    
+public:
+    
+    using Pointer = std::shared_ptr<const T>;
+    
+    AtomicSnapshot()
+    : AtomicSnapshot(std::make_shared<const T>())
+    {}
+    
+    explicit AtomicSnapshot(Pointer value)
+    : mCurrent(new Node { std::move(value) })
+    , mEpoch(0)
+    {
+        mReaders[0] = 0;
+        mReaders[1] = 0;
+    }
+    
+    ~AtomicSnapshot()
+    {
+        delete mCurrent.load();
+    }
+    
+    AtomicSnapshot(const AtomicSnapshot&) = delete;
+    AtomicSnapshot& operator=(const AtomicSnapshot&) = delete;
+    
+    Pointer Load() const
+    {
+        while (true)
+        {
+            uint64_t epoch = mEpoch.load();
+            std::atomic<int>& readers = mReaders[epoch & 1];
+            
+            readers++;
+            
+            if (mEpoch.load() == epoch)
+            {
+                Pointer value = mCurrent.load()->mValue;
+                readers--;
+                return value;
+            }
+            
+            readers--;
+        }
+    }
+    
+    void Store(Pointer value)
+    {
+        Node *previous = mCurrent.exchange(new Node { std::move(value) });
+        uint64_t epoch = mEpoch.fetch_add(1);
+        
+        // Wait for any reader that may still be using the previous node
+        
+        while (mReaders[epoch & 1].load())
+            std::this_thread::yield();
+        
+        delete previous;
+    }
+    
+private:
+    
+    std::atomic<Node *> mCurrent;
+    std::atomic<uint64_t> mEpoch;
+    mutable std::atomic<int> mReaders[2];
+};
+
+#endif /* ATOMICSNAPSHOT_HPP */
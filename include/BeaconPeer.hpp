@@ -0,0 +1,434 @@
+
+#ifndef BEACONPEER_HPP
+#define BEACONPEER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "IPlugLogger.h"
+
+#include "DiscoverySnapshot.hpp"
+#include "NetworkData.hpp"
+
+// Metadata that peers publish so that they can be ranked without connecting
+
+struct BeaconMetadata
+{
+    uint32_t mLoad = 0;
+    uint32_t mProtocolVersion = 0;
+    uint32_t mCapabilities = 0;
+};
+
+// A service announced by a UDP multicast beacon
+
+class BeaconService
+{
+public:
+    
+    BeaconService(const std::string& name, const std::string& host, uint16_t port, uint64_t instanceID, const BeaconMetadata& metadata)
+    : mName(name)
+    , mHost(host)
+    , mPort(port)
+    , mInstanceID(instanceID)
+    , mMetadata(metadata)
+    {}
+    
+    const std::string& Name() const { return mName; }
+    const std::string& Host() const { return mHost; }
+    uint16_t Port() const { return mPort; }
+    uint64_t InstanceID() const { return mInstanceID; }
+    uint32_t Load() const { return mMetadata.mLoad; }
+    const BeaconMetadata& Metadata() const { return mMetadata; }
+    
+private:
+    
+    std::string mName;
+    std::string mHost;
+    uint16_t mPort;
+    uint64_t mInstanceID;
+    BeaconMetadata mMetadata;
+};
+
+// A lightweight discovery backend based on UDP multicast beacons
+// Each peer announces its host, port, instance ID and metadata several times a second
+// Peers that have not been heard from within the expiry time are removed
+
+class BeaconPeer
+{
+    using Clock = std::chrono::steady_clock;
+    
+    static constexpr const char *sBeaconTag = "IPNB";
+    static constexpr int sBeaconVersion = 2;
+    static constexpr int sAnnounceMS = 250;
+    static constexpr int sExpiryMS = 1000;
+    static constexpr int sMaxPacket = 1024;
+    
+    struct Entry
+    {
+        BeaconService mService;
+        Clock::time_point mLastSeen;
+    };
+    
+public:
+    
+    using Service = BeaconService;
+    using ServiceSnapshot = DiscoverySnapshot<Service, uint64_t>;
+    using ServiceList = ServiceSnapshot::List;
+    using Snapshot = ServiceSnapshot::Pointer;
+    using ServiceHandler = ServiceSnapshot::ServiceHandler;
+    using ChangeHandler = ServiceSnapshot::ChangeHandler;
+    
+    BeaconPeer(const char* name, const char* regname, uint16_t port, uint64_t instanceID)
+    : mName(name)
+    , mRegName(regname)
+    , mPort(port)
+    , mInstanceID(instanceID)
+    , mLoad(0)
+    , mProtocolVersion(0)
+    , mCapabilities(0)
+    , mGroup("239.255.42.99")
+    , mGroupPort(45454)
+    , mInterface("0.0.0.0")
+    , mSocket(-1)
+    , mActive(false)
+    , mSnapshot(ServiceKey, ServiceChanged, MetadataChanged)
+    {}
+    
+    ~BeaconPeer()
+    {
+        Stop();
+    }
+    
+    BeaconPeer(const BeaconPeer&) = delete;
+    BeaconPeer& operator=(const BeaconPeer&) = delete;
+    
+    // Configuration (takes effect on the next start)
+    // Setting the interface to "127.0.0.1" keeps beacons on the loopback interface (useful for tests)
+    
+    void SetGroup(const char* group, uint16_t port)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        mGroup = group;
+        mGroupPort = port;
+    }
+    
+    void SetInterface(const char* address)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        mInterface = address;
+    }
+    
+    void SetLoad(uint32_t load)
+    {
+        mLoad = load;
+    }
+    
+    void SetProtocol(uint32_t version, uint32_t capabilities)
+    {
+        mProtocolVersion = version;
+        mCapabilities = capabilities;
+    }
+    
+    // The announced port and instance ID may be changed whilst running
+    
+    void SetService(uint16_t port, uint64_t instanceID)
+    {
+        mPort = port;
+        mInstanceID = instanceID;
+    }
+    
+    uint64_t InstanceID() const
+    {
+        return mInstanceID;
+    }
+    
+    uint16_t Port() const
+    {
+        return mPort;
+    }
+    
+    void Start()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        if (mActive)
+            return;
+        
+        mSocket = OpenSocket();
+        
+        if (mSocket < 0)
+        {
+            DBGMSG("BEACON: Could not open socket\n");
+            return;
+        }
+        
+        DBGMSG("BEACON: Started\n");
+        
+        mActive = true;
+        mThread = std::thread([this]() { Run(); });
+    }
+    
+    void Stop()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        
+        if (!mActive)
+            return;
+        
+        mActive = false;
+        lock.unlock();
+        mThread.join();
+        lock.lock();
+        
+        close(mSocket);
+        mSocket = -1;
+        mEntries.clear();
+        mSnapshot.Publish(ServiceList());
+        
+        DBGMSG("BEACON: Stopped\n");
+    }
+    
+    bool IsRunning() const
+    {
+        return mActive;
+    }
+    
+    void SetHandlers(ServiceHandler added, ServiceHandler removed, ChangeHandler changed, ServiceHandler updated = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        mSnapshot.SetHandlers(std::move(added), std::move(removed), std::move(changed), std::move(updated));
+    }
+    
+    // Expire stale peers, notify any differences and return the current version
+    // N.B. handlers are called with the mutex held and should not call back into the beacon
+    
+    uint64_t FindPeers()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        auto expiry = Clock::now() - std::chrono::milliseconds(sExpiryMS);
+        ServiceList peers;
+        
+        for (auto it = mEntries.begin(); it != mEntries.end(); )
+        {
+            if (it->second.mLastSeen < expiry)
+                it = mEntries.erase(it);
+            else
+                peers.push_back((it++)->second.mService);
+        }
+        
+        mSnapshot.Publish(std::move(peers));
+        
+        return mSnapshot.Version();
+    }
+    
+    Snapshot Peers() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        return mSnapshot.Get();
+    }
+    
+    uint64_t Churn() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        return mSnapshot.Churn();
+    }
+    
+private:
+    
+    static uint64_t ServiceKey(const BeaconService& service)
+    {
+        return service.InstanceID();
+    }
+    
+    // Only the address identifies a service (metadata changes are passed as updates rather than changes)
+    
+    static bool ServiceChanged(const BeaconService& a, const BeaconService& b)
+    {
+        return a.Host() != b.Host() || a.Port() != b.Port() || a.Name() != b.Name();
+    }
+    
+    static bool MetadataChanged(const BeaconService& a, const BeaconService& b)
+    {
+        const BeaconMetadata& m1 = a.Metadata();
+        const BeaconMetadata& m2 = b.Metadata();
+        
+        return m1.mLoad != m2.mLoad || m1.mProtocolVersion != m2.mProtocolVersion || m1.mCapabilities != m2.mCapabilities;
+    }
+    
+    int OpenSocket() const
+    {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        
+        if (fd < 0)
+            return -1;
+        
+        int on = 1;
+        unsigned char loop = 1;
+        unsigned char ttl = 1;
+        
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(mGroupPort);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        
+        ip_mreq membership {};
+        inet_pton(AF_INET, mGroup.c_str(), &membership.imr_multiaddr);
+        inet_pton(AF_INET, mInterface.c_str(), &membership.imr_interface);
+        
+        bool success = !setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+        success = success && !setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+        success = success && !bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+        success = success && !setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership));
+        success = success && !setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &membership.imr_interface, sizeof(in_addr));
+        success = success && !setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        success = success && !setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        
+        if (!success)
+        {
+            close(fd);
+            return -1;
+        }
+        
+        return fd;
+    }
+    
+    // The beacon thread announces at a regular interval and receives between announcements
+    
+    void Run()
+    {
+        sockaddr_in group {};
+        
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            
+            group.sin_family = AF_INET;
+            group.sin_port = htons(mGroupPort);
+            inet_pton(AF_INET, mGroup.c_str(), &group.sin_addr);
+        }
+        
+        auto next = Clock::now();
+        
+        while (mActive)
+        {
+            auto now = Clock::now();
+            
+            if (now >= next)
+            {
+                Announce(group);
+                next = now + std::chrono::milliseconds(sAnnounceMS);
+            }
+            
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+            pollfd descriptor { mSocket, POLLIN, 0 };
+            
+            if (poll(&descriptor, 1, static_cast<int>(std::max<decltype(wait)>(1, wait))) > 0)
+                Receive();
+        }
+    }
+    
+    void Announce(const sockaddr_in& group)
+    {
+        BeaconMetadata metadata;
+        
+        metadata.mLoad = mLoad;
+        metadata.mProtocolVersion = mProtocolVersion;
+        metadata.mCapabilities = mCapabilities;
+        
+        NetworkByteChunk chunk(sBeaconTag, sBeaconVersion, mRegName.c_str(), mName.c_str(), mPort.load(), mInstanceID.load());
+        chunk.Add(metadata.mLoad, metadata.mProtocolVersion, metadata.mCapabilities);
+        
+        sendto(mSocket, chunk.GetData(), chunk.Size(), 0, reinterpret_cast<const sockaddr *>(&group), sizeof(group));
+    }
+    
+    void Receive()
+    {
+        uint8_t buffer[sMaxPacket];
+        sockaddr_in sender {};
+        socklen_t senderLength = sizeof(sender);
+        
+        auto size = recvfrom(mSocket, buffer, sMaxPacket, 0, reinterpret_cast<sockaddr *>(&sender), &senderLength);
+        
+        if (size <= 0)
+            return;
+        
+        iplug::IByteStream data(buffer, static_cast<int>(size));
+        NetworkByteStream stream(data);
+        
+        WDL_String regname, name;
+        int version = 0;
+        uint16_t port = 0;
+        uint64_t instanceID = 0;
+        BeaconMetadata metadata;
+        
+        if (!stream.IsNextTag(sBeaconTag))
+            return;
+        
+        stream.Get(version);
+        
+        if (version != sBeaconVersion)
+            return;
+        
+        stream.Get(regname, name, port, instanceID);
+        stream.Get(metadata.mLoad, metadata.mProtocolVersion, metadata.mCapabilities);
+        
+        // Ignore malformed packets, other services and our own beacon
+        
+        if (stream.Tell() < 0 || mRegName != regname.Get() || instanceID == mInstanceID)
+            return;
+        
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &sender.sin_addr, host, INET_ADDRSTRLEN);
+        
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        Entry entry { BeaconService(name.Get(), host, port, instanceID, metadata), Clock::now() };
+        
+        auto it = mEntries.find(instanceID);
+        
+        if (it == mEntries.end())
+            mEntries.emplace(instanceID, entry);
+        else
+            it->second = entry;
+    }
+    
+    const std::string mName;
+    const std::string mRegName;
+    std::atomic<uint16_t> mPort;
+    std::atomic<uint64_t> mInstanceID;
+    std::atomic<uint32_t> mLoad;
+    std::atomic<uint32_t> mProtocolVersion;
+    std::atomic<uint32_t> mCapabilities;
+    
+    std::string mGroup;
+    uint16_t mGroupPort;
+    std::string mInterface;
+    
+    int mSocket;
+    std::atomic<bool> mActive;
+    std::thread mThread;
+    
+    mutable std::mutex mMutex;
+    std::unordered_map<uint64_t, Entry> mEntries;
+    ServiceSnapshot mSnapshot;
+};
+
+#endif /* BEACONPEER_HPP */
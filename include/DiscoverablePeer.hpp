@@ -2,21 +2,43 @@
 #ifndef DISCOVERABLEPEER_HPP
 #define DISCOVERABLEPEER_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <string>
+#include <unordered_map>
 
 #include <unistd.h>
 
 #include "IPlugLogger.h"
 
+#include "DiscoverySnapshot.hpp"
+
 #include "../dependencies/bonjour-for-cpp/bonjour-for-cpp.hpp"
 
 class DiscoverablePeer : private bonjour_peer
 {
 public:
     
+    // Found peers are published as immutable versioned snapshots
+    // Handlers are called on the thread calling FindPeers() for each difference between snapshots
+    // N.B. handlers are called with the mutex held (it is recursive so handlers may query the snapshot)
+    
+    using Service = bonjour_service;
+    using ServiceSnapshot = DiscoverySnapshot<Service, std::string>;
+    using ServiceList = ServiceSnapshot::List;
+    using Snapshot = ServiceSnapshot::Pointer;
+    using ServiceHandler = ServiceSnapshot::ServiceHandler;
+    using ChangeHandler = ServiceSnapshot::ChangeHandler;
+    
     DiscoverablePeer(const char* name, const char* regname, uint16_t port)
     : bonjour_peer(ConformName(name).c_str(), RegNameConcat(regname).c_str(), "", port)
+    , mActive(false)
+    , mSnapshot(ServiceName, ServiceChanged)
+    , mResolveHits(0)
+    , mResolveMisses(0)
+    , mStarts(0)
     {}
     
     static WDL_String GetStaticHostName()
@@ -64,6 +86,7 @@ public:
         DBGMSG("PEER: Started\n");
         
         mActive = true;
+        mStarts++;
         
         // Setup peer discovery
         
@@ -78,7 +101,8 @@ public:
         
         mActive = false;
         bonjour_peer::stop();
-        mPeers.clear();
+        
+        mSnapshot.Publish(ServiceList());
     }
     
     bool IsRunning() const
@@ -86,29 +110,169 @@ public:
         return mActive;
     }
     
-    std::list<bonjour_service>& FindPeers()
+    void SetHandlers(ServiceHandler added, ServiceHandler removed, ChangeHandler changed, ServiceHandler updated = nullptr)
+    {
+        WDL_MutexLock lock(&mMutex);
+        
+        mSnapshot.SetHandlers(std::move(added), std::move(removed), std::move(changed), std::move(updated));
+    }
+    
+    // Update the snapshot from the browser, notify any differences and return the current version
+    
+    uint64_t FindPeers()
+    {
+        WDL_MutexLock lock(&mMutex);
+        
+        ServiceList peers;
+        bonjour_peer::list_peers(peers);
+        
+        for (auto it = peers.begin(); it != peers.end(); it++)
+        {
+            if (!it->host().empty())
+            {
+                mResolveCache.Resolved(it->name());
+                mResolveCache.Resolved(it->host());
+            }
+        }
+        
+        mSnapshot.Publish(std::move(peers));
+        
+        return mSnapshot.Version();
+    }
+    
+    Snapshot Peers() const
+    {
+        WDL_MutexLock lock(&mMutex);
+        
+        return mSnapshot.Get();
+    }
+    
+    uint64_t Version() const
     {
         WDL_MutexLock lock(&mMutex);
         
-        bonjour_peer::list_peers(mPeers);
+        return mSnapshot.Version();
+    }
+    
+    // Take over the peers found by another instance (without notifying handlers)
+    
+    void Adopt(const DiscoverablePeer& previous)
+    {
+        WDL_MutexLock lock(&mMutex);
         
-        return mPeers;
+        mSnapshot.Seed(previous.Peers());
     }
     
-    std::list<bonjour_service> Peers() const
+    // Resolves are only issued if the name has not resolved recently or is not backing off after failing
+    
+    bool Resolve(const char* name)
     {
         WDL_MutexLock lock(&mMutex);
         
-        return mPeers;
+        if (!mResolveCache.Request(name))
+        {
+            mResolveHits++;
+            return false;
+        }
+        
+        mResolveMisses++;
+        bonjour_peer::resolve(bonjour_named(name, RegType(), Domain()));
+        
+        return true;
     }
     
-    void Resolve(const char* host)
+    uint64_t ResolveHits() const { return mResolveHits; }
+    uint64_t ResolveMisses() const { return mResolveMisses; }
+    
+    // Counts of registrations and of peers added, removed or changed between snapshots
+    
+    uint64_t Starts() const { return mStarts; }
+    
+    uint64_t Churn() const
     {
-        bonjour_peer::resolve(bonjour_named(host, RegType(), Domain()));
+        WDL_MutexLock lock(&mMutex);
+        
+        return mSnapshot.Churn();
     }
     
 private:
     
+    // Snapshot keys and comparison
+    
+    static std::string ServiceName(const bonjour_service& service)
+    {
+        return service.name();
+    }
+    
+    static bool ServiceChanged(const bonjour_service& a, const bonjour_service& b)
+    {
+        return a.host() != b.host() || a.port() != b.port();
+    }
+    
+    // A cache of resolution attempts by name with a positive TTL and exponential negative backoff
+    
+    class ResolveCache
+    {
+        using Clock = std::chrono::steady_clock;
+        using Seconds = std::chrono::duration<double>;
+        
+        static constexpr double sPositiveTTL = 60.0;
+        static constexpr double sInitialBackoff = 2.0;
+        static constexpr double sMaxBackoff = 64.0;
+        
+        struct Entry
+        {
+            Clock::time_point mExpiry;
+            double mBackoff = 0.0;
+        };
+        
+    public:
+        
+        // Returns true if a resolve should be issued (a miss) and records the attempt
+        
+        bool Request(const std::string& name)
+        {
+            auto now = Clock::now();
+            
+            Purge(now);
+            
+            Entry& entry = mEntries[name];
+            
+            if (now < entry.mExpiry)
+                return false;
+            
+            entry.mBackoff = std::min(sMaxBackoff, std::max(sInitialBackoff, entry.mBackoff * 2.0));
+            entry.mExpiry = now + std::chrono::duration_cast<Clock::duration>(Seconds(entry.mBackoff));
+            
+            return true;
+        }
+        
+        void Resolved(const std::string& name)
+        {
+            Entry& entry = mEntries[name];
+            
+            entry.mBackoff = 0.0;
+            entry.mExpiry = Clock::now() + std::chrono::duration_cast<Clock::duration>(Seconds(sPositiveTTL));
+        }
+        
+    private:
+        
+        void Purge(Clock::time_point now)
+        {
+            auto stale = std::chrono::duration_cast<Clock::duration>(Seconds(sMaxBackoff));
+            
+            for (auto it = mEntries.begin(); it != mEntries.end(); )
+            {
+                if (it->second.mExpiry + stale < now)
+                    it = mEntries.erase(it);
+                else
+                    it++;
+            }
+        }
+        
+        std::unordered_map<std::string, Entry> mEntries;
+    };
+    
     static std::string RegNameConcat(const char* regname)
     {
         return std::string("_") + regname + std::string("._tcp.");
@@ -130,7 +294,12 @@ private:
     
     mutable WDL_Mutex mMutex;
     bool mActive;
-    std::list<bonjour_service> mPeers;
+    ServiceSnapshot mSnapshot;
+    
+    ResolveCache mResolveCache;
+    std::atomic<uint64_t> mResolveHits;
+    std::atomic<uint64_t> mResolveMisses;
+    std::atomic<uint64_t> mStarts;
 };
 
 #endif /* DISCOVERABLEPEER_HPP */
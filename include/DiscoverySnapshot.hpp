@@ -0,0 +1,156 @@
+
+#ifndef DISCOVERYSNAPSHOT_HPP
+#define DISCOVERYSNAPSHOT_HPP
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A versioned, immutable snapshot of discovered services that notifies handlers of any differences
+// Services are matched by key and are changed if the comparison function reports a difference
+// Services may also be updated (e.g. for metadata) which replaces the snapshot without counting as a new version
+// N.B. this is not threadsafe - the owner is expected to serialise calls
+
+template <class Service, class Key>
+class DiscoverySnapshot
+{
+public:
+    
+    using List = std::list<Service>;
+    using Pointer = std::shared_ptr<const List>;
+    using ServiceHandler = std::function<void(const Service&)>;
+    using ChangeHandler = std::function<void(const Service&, const Service&)>;
+    using KeyFunction = Key (*)(const Service&);
+    using ChangedFunction = bool (*)(const Service&, const Service&);
+    
+    DiscoverySnapshot(KeyFunction key, ChangedFunction changed, ChangedFunction updated = nullptr)
+    : mKey(key)
+    , mChanged(changed)
+    , mUpdated(updated)
+    , mSnapshot(std::make_shared<const List>())
+    , mVersion(0)
+    , mChurn(0)
+    {}
+    
+    void SetHandlers(ServiceHandler added, ServiceHandler removed, ChangeHandler changed, ServiceHandler updated = nullptr)
+    {
+        mAddedHandler = std::move(added);
+        mRemovedHandler = std::move(removed);
+        mChangedHandler = std::move(changed);
+        mUpdatedHandler = std::move(updated);
+    }
+    
+    // Publish a new list of services (only creating a new version if something has changed)
+    
+    bool Publish(List&& services)
+    {
+        std::unordered_map<Key, const Service *> previous;
+        std::vector<const Service *> added;
+        std::vector<std::pair<const Service *, const Service *>> changed;
+        std::vector<const Service *> updated;
+        
+        // N.B. the previous snapshot is held until handlers have been called
+        
+        auto snapshot = mSnapshot;
+        
+        for (auto it = snapshot->begin(); it != snapshot->end(); it++)
+            previous[mKey(*it)] = &*it;
+        
+        auto next = std::make_shared<const List>(std::move(services));
+        
+        for (auto it = next->begin(); it != next->end(); it++)
+        {
+            auto match = previous.find(mKey(*it));
+            
+            if (match == previous.end())
+                added.push_back(&*it);
+            else
+            {
+                if (mChanged(*match->second, *it))
+                    changed.emplace_back(match->second, &*it);
+                else if (mUpdated && mUpdated(*match->second, *it))
+                    updated.push_back(&*it);
+                
+                previous.erase(match);
+            }
+        }
+        
+        if (added.empty() && changed.empty() && previous.empty())
+        {
+            if (updated.empty())
+                return false;
+            
+            mSnapshot = next;
+            
+            if (mUpdatedHandler)
+            {
+                for (auto it = updated.begin(); it != updated.end(); it++)
+                    mUpdatedHandler(**it);
+            }
+            
+            return false;
+        }
+        
+        mSnapshot = next;
+        mVersion++;
+        mChurn += added.size() + changed.size() + previous.size();
+        
+        if (mRemovedHandler)
+        {
+            for (auto it = previous.begin(); it != previous.end(); it++)
+                mRemovedHandler(*it->second);
+        }
+        
+        if (mChangedHandler)
+        {
+            for (auto it = changed.begin(); it != changed.end(); it++)
+                mChangedHandler(*it->first, *it->second);
+        }
+        
+        if (mAddedHandler)
+        {
+            for (auto it = added.begin(); it != added.end(); it++)
+                mAddedHandler(**it);
+        }
+        
+        if (mUpdatedHandler)
+        {
+            for (auto it = updated.begin(); it != updated.end(); it++)
+                mUpdatedHandler(**it);
+        }
+        
+        return true;
+    }
+    
+    // Start from an existing snapshot without notifying handlers (so that a replacement only reports real differences)
+    
+    void Seed(Pointer snapshot)
+    {
+        mSnapshot = snapshot;
+    }
+    
+    Pointer Get() const { return mSnapshot; }
+    uint64_t Version() const { return mVersion; }
+    uint64_t Churn() const { return mChurn; }
+    
+private:
+    
+    KeyFunction mKey;
+    ChangedFunction mChanged;
+    ChangedFunction mUpdated;
+    
+    Pointer mSnapshot;
+    uint64_t mVersion;
+    uint64_t mChurn;
+    
+    ServiceHandler mAddedHandler;
+    ServiceHandler mRemovedHandler;
+    ChangeHandler mChangedHandler;
+    ServiceHandler mUpdatedHandler;
+};
+
+#endif /* DISCOVERYSNAPSHOT_HPP */
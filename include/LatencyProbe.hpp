@@ -0,0 +1,319 @@
+#ifndef LATENCYPROBE_HPP
+#define LATENCYPROBE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "IPlugLogger.h"
+
+#include "NetworkData.hpp"
+
+// Direct round trip measurements between peers (so that a server can learn the latency between its clients)
+// Each peer echoes probes on a UDP socket bound to its server port and times the echoes of its own probes
+// Round trips are smoothed as for TCP (with a gain of 1/8) and expire when no echo has been heard for a while
+
+class LatencyProbe
+{
+    using Clock = std::chrono::steady_clock;
+    
+    static constexpr const char *sProbeTag = "IPNP";
+    static constexpr int sProbeVersion = 1;
+    static constexpr int sProbe = 0;
+    static constexpr int sEcho = 1;
+    static constexpr int sPollMS = 100;
+    static constexpr int sExpiryMS = 10000;
+    static constexpr int sMaxPacket = 256;
+    
+    struct Entry
+    {
+        double mRTT;
+        Clock::time_point mLastSeen;
+    };
+    
+    struct Address
+    {
+        sockaddr_in mAddress;
+        bool mResolved;
+        Clock::time_point mTime;
+    };
+    
+public:
+    
+    // Round trips in milliseconds by instance ID
+    
+    using Links = std::vector<std::pair<uint64_t, double>>;
+    
+    LatencyProbe(uint64_t instanceID)
+    : mInstanceID(instanceID)
+    , mSocket(-1)
+    , mActive(false)
+    {}
+    
+    ~LatencyProbe()
+    {
+        Stop();
+    }
+    
+    LatencyProbe(const LatencyProbe&) = delete;
+    LatencyProbe& operator=(const LatencyProbe&) = delete;
+    
+    // N.B. if the port cannot be bound then probes are neither sent nor answered
+    
+    void Start(uint16_t port)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        if (mActive)
+            return;
+        
+        mSocket = OpenSocket(port);
+        
+        if (mSocket < 0)
+        {
+            DBGMSG("PROBE: Could not open socket\n");
+            return;
+        }
+        
+        mActive = true;
+        mThread = std::thread([this]() { Run(); });
+    }
+    
+    void Stop()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        
+        if (!mActive)
+            return;
+        
+        mActive = false;
+        lock.unlock();
+        mThread.join();
+        lock.lock();
+        
+        close(mSocket);
+        mSocket = -1;
+        mEntries.clear();
+        mAddresses.clear();
+    }
+    
+    bool IsRunning() const
+    {
+        return mActive;
+    }
+    
+    // Send a probe to a peer (the echo updates its round trip)
+    // N.B. host names are resolved on first use (which may block) and then cached (failures are retried after the expiry time)
+    
+    void Probe(const char* host, uint16_t port, uint64_t id)
+    {
+        sockaddr_in address {};
+        
+        if (!mActive || !id || id == mInstanceID || !Resolve(host, port, address))
+            return;
+        
+        NetworkByteChunk chunk(sProbeTag, sProbeVersion, sProbe, mInstanceID, Now());
+        
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        if (mSocket >= 0)
+            sendto(mSocket, chunk.GetData(), chunk.Size(), 0, reinterpret_cast<const sockaddr *>(&address), sizeof(address));
+    }
+    
+    Links Get() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        auto expiry = Clock::now() - std::chrono::milliseconds(sExpiryMS);
+        Links links;
+        
+        for (auto it = mEntries.begin(); it != mEntries.end(); it++)
+        {
+            if (it->second.mLastSeen >= expiry)
+                links.emplace_back(it->first, it->second.mRTT);
+        }
+        
+        return links;
+    }
+    
+    // Find the round trip for a given instance ID in a set of links
+    
+    static bool Find(const Links& links, uint64_t id, double& rtt)
+    {
+        for (auto it = links.begin(); it != links.end(); it++)
+        {
+            if (it->first == id)
+            {
+                rtt = it->second;
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+private:
+    
+    static uint64_t Now()
+    {
+        auto now = Clock::now().time_since_epoch();
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+    }
+    
+    int OpenSocket(uint16_t port) const
+    {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        
+        if (fd < 0)
+            return -1;
+        
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        
+        if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)))
+        {
+            close(fd);
+            return -1;
+        }
+        
+        return fd;
+    }
+    
+    bool Resolve(const char* host, uint16_t port, sockaddr_in& address)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            
+            auto it = mAddresses.find(host);
+            auto expiry = Clock::now() - std::chrono::milliseconds(sExpiryMS);
+            
+            if (it != mAddresses.end() && (it->second.mResolved || it->second.mTime >= expiry))
+            {
+                address = it->second.mAddress;
+                address.sin_port = htons(port);
+                return it->second.mResolved;
+            }
+        }
+        
+        addrinfo hints {};
+        addrinfo *result = nullptr;
+        
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        
+        bool resolved = !getaddrinfo(host, nullptr, &hints, &result) && result;
+        
+        if (resolved)
+        {
+            address = *reinterpret_cast<const sockaddr_in *>(result->ai_addr);
+            freeaddrinfo(result);
+        }
+        
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        mAddresses[host] = Address { address, resolved, Clock::now() };
+        address.sin_port = htons(port);
+        return resolved;
+    }
+    
+    void Run()
+    {
+        while (mActive)
+        {
+            pollfd descriptor { mSocket, POLLIN, 0 };
+            
+            if (poll(&descriptor, 1, sPollMS) > 0)
+                Receive();
+        }
+    }
+    
+    // Probes are echoed with their time and echoes of our own probes give a round trip
+    
+    void Receive()
+    {
+        uint8_t buffer[sMaxPacket];
+        sockaddr_in sender {};
+        socklen_t senderLength = sizeof(sender);
+        
+        auto size = recvfrom(mSocket, buffer, sMaxPacket, 0, reinterpret_cast<sockaddr *>(&sender), &senderLength);
+        
+        if (size <= 0)
+            return;
+        
+        iplug::IByteStream data(buffer, static_cast<int>(size));
+        NetworkByteStream stream(data);
+        
+        int version = 0;
+        int type = 0;
+        uint64_t instanceID = 0;
+        uint64_t time = 0;
+        
+        if (!stream.IsNextTag(sProbeTag))
+            return;
+        
+        stream.Get(version);
+        
+        if (version != sProbeVersion)
+            return;
+        
+        stream.Get(type, instanceID, time);
+        
+        // Ignore malformed packets and our own probes
+        
+        if (stream.Tell() < 0 || !instanceID || instanceID == mInstanceID)
+            return;
+        
+        if (type == sProbe)
+        {
+            NetworkByteChunk chunk(sProbeTag, sProbeVersion, sEcho, mInstanceID, time);
+            sendto(mSocket, chunk.GetData(), chunk.Size(), 0, reinterpret_cast<const sockaddr *>(&sender), senderLength);
+        }
+        else if (type == sEcho)
+        {
+            uint64_t now = Now();
+            
+            if (time > now)
+                return;
+            
+            double rtt = (now - time) / 1000.0;
+            
+            std::lock_guard<std::mutex> lock(mMutex);
+            
+            auto it = mEntries.find(instanceID);
+            auto expiry = Clock::now() - std::chrono::milliseconds(sExpiryMS);
+            
+            if (it == mEntries.end())
+                mEntries.emplace(instanceID, Entry { rtt, Clock::now() });
+            else if (it->second.mLastSeen < expiry)
+                it->second = Entry { rtt, Clock::now() };
+            else
+                it->second = Entry { it->second.mRTT + (rtt - it->second.mRTT) / 8.0, Clock::now() };
+        }
+    }
+    
+    const uint64_t mInstanceID;
+    
+    int mSocket;
+    std::atomic<bool> mActive;
+    std::thread mThread;
+    
+    mutable std::mutex mMutex;
+    std::unordered_map<uint64_t, Entry> mEntries;
+    std::unordered_map<std::string, Address> mAddresses;
+};
+
+#endif /* LATENCYPROBE_HPP */
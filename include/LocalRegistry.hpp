@@ -0,0 +1,366 @@
+
+#ifndef LOCALREGISTRY_HPP
+#define LOCALREGISTRY_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "IPlugLogger.h"
+
+#include "BeaconPeer.hpp"
+#include "DiscoverySnapshot.hpp"
+
+// A peer registered on the same host
+
+class LocalService
+{
+public:
+    
+    LocalService(uint64_t instanceID, uint16_t port, const BeaconMetadata& metadata)
+    : mInstanceID(instanceID)
+    , mPort(port)
+    , mMetadata(metadata)
+    {}
+    
+    uint64_t InstanceID() const { return mInstanceID; }
+    uint16_t Port() const { return mPort; }
+    const BeaconMetadata& Metadata() const { return mMetadata; }
+    
+private:
+    
+    uint64_t mInstanceID;
+    uint16_t mPort;
+    BeaconMetadata mMetadata;
+};
+
+// A registry of the peers on this host held in POSIX shared memory
+// Each instance claims a slot (which also determines its port) and updates a heartbeat counter
+// Slots are reclaimed if their owning process has exited (or its heartbeat has long stalled, in case the process ID
+// was reused) and peers are expired if their heartbeat stalls
+// A claim takes the slot's process before the slot is filled in and its instance published (readers skip slots without one)
+
+class LocalRegistry
+{
+    using Clock = std::chrono::steady_clock;
+    
+    static constexpr int sNumSlots = 64;
+    static constexpr int sExpiryMS = 5000;
+    static constexpr int sReclaimMS = 60000;
+    static constexpr size_t sMaxNameLength = 31;
+    
+    struct Slot
+    {
+        std::atomic<uint64_t> mInstanceID;
+        std::atomic<uint64_t> mHeartbeat;
+        std::atomic<int64_t> mBeatTime;
+        std::atomic<int32_t> mProcess;
+        std::atomic<uint32_t> mPort;
+        std::atomic<uint32_t> mLoad;
+        std::atomic<uint32_t> mProtocolVersion;
+        std::atomic<uint32_t> mCapabilities;
+    };
+    
+    struct Region
+    {
+        Slot mSlots[sNumSlots];
+    };
+    
+    struct Liveness
+    {
+        uint64_t mHeartbeat;
+        Clock::time_point mChanged;
+        uint64_t mScan;
+    };
+    
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory atomics must be lock free");
+    
+public:
+    
+    using Service = LocalService;
+    using ServiceSnapshot = DiscoverySnapshot<Service, uint64_t>;
+    using ServiceList = ServiceSnapshot::List;
+    using Snapshot = ServiceSnapshot::Pointer;
+    using ServiceHandler = ServiceSnapshot::ServiceHandler;
+    using ChangeHandler = ServiceSnapshot::ChangeHandler;
+    
+    LocalRegistry(const char* regname, uint64_t instanceID, uint16_t basePort)
+    : mInstanceID(instanceID)
+    , mBasePort(basePort)
+    , mRegion(nullptr)
+    , mSlot(nullptr)
+    , mScan(0)
+    , mSnapshot(ServiceKey, ServiceChanged, MetadataChanged)
+    {
+        std::string name = RegionName(regname);
+        
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+        
+        if (fd < 0)
+        {
+            DBGMSG("REGISTRY: Could not open shared memory\n");
+            return;
+        }
+        
+        // N.B. new shared memory is zero-filled which is a valid (empty) state for all slots
+        
+        if (ftruncate(fd, sizeof(Region)) == 0)
+        {
+            void *memory = mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            
+            if (memory != MAP_FAILED)
+                mRegion = static_cast<Region *>(memory);
+        }
+        
+        close(fd);
+        
+        if (mRegion)
+            Claim();
+    }
+    
+    ~LocalRegistry()
+    {
+        // N.B. the instance is withdrawn before the slot is freed (and a slot reclaimed by another process is left alone)
+        
+        if (mSlot)
+        {
+            uint64_t expected = mInstanceID;
+            int32_t process = static_cast<int32_t>(getpid());
+            
+            if (mSlot->mInstanceID.compare_exchange_strong(expected, 0))
+                mSlot->mProcess.compare_exchange_strong(process, 0);
+        }
+        
+        if (mRegion)
+            munmap(mRegion, sizeof(Region));
+    }
+    
+    LocalRegistry(const LocalRegistry&) = delete;
+    LocalRegistry& operator=(const LocalRegistry&) = delete;
+    
+    bool IsActive() const
+    {
+        return mSlot;
+    }
+    
+    // Each instance on the host listens on the base port offset by its slot index
+    
+    uint16_t Port() const
+    {
+        return mSlot ? static_cast<uint16_t>(mSlot->mPort.load()) : mBasePort;
+    }
+    
+    void Heartbeat(uint32_t load, uint32_t protocolVersion, uint32_t capabilities)
+    {
+        if (mSlot)
+        {
+            mSlot->mLoad.store(load, std::memory_order_relaxed);
+            mSlot->mProtocolVersion.store(protocolVersion, std::memory_order_relaxed);
+            mSlot->mCapabilities.store(capabilities, std::memory_order_relaxed);
+            mSlot->mBeatTime.store(Now(), std::memory_order_relaxed);
+            mSlot->mHeartbeat.fetch_add(1, std::memory_order_release);
+        }
+    }
+    
+    void SetHandlers(ServiceHandler added, ServiceHandler removed, ChangeHandler changed, ServiceHandler updated = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        mSnapshot.SetHandlers(std::move(added), std::move(removed), std::move(changed), std::move(updated));
+    }
+    
+    // Scan the registry, notify any differences and return the current version
+    // N.B. handlers are called with the mutex held and should not call back into the registry
+    
+    uint64_t FindPeers()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        if (!mRegion)
+            return mSnapshot.Version();
+        
+        auto now = Clock::now();
+        auto expiry = now - std::chrono::milliseconds(sExpiryMS);
+        ServiceList peers;
+        
+        mScan++;
+        
+        for (int i = 0; i < sNumSlots; i++)
+        {
+            Slot& slot = mRegion->mSlots[i];
+            
+            uint64_t id = slot.mInstanceID.load(std::memory_order_acquire);
+            uint64_t heartbeat = slot.mHeartbeat.load(std::memory_order_acquire);
+            
+            if (!id || id == mInstanceID)
+                continue;
+            
+            // Track when the heartbeat last changed to detect stalled peers
+            
+            auto it = mLiveness.find(id);
+            
+            if (it == mLiveness.end())
+                it = mLiveness.emplace(id, Liveness { heartbeat, now, mScan }).first;
+            else if (it->second.mHeartbeat != heartbeat)
+                it->second = Liveness { heartbeat, now, mScan };
+            else
+                it->second.mScan = mScan;
+            
+            if (it->second.mChanged < expiry)
+                continue;
+            
+            BeaconMetadata metadata;
+            
+            metadata.mLoad = slot.mLoad.load(std::memory_order_relaxed);
+            metadata.mProtocolVersion = slot.mProtocolVersion.load(std::memory_order_relaxed);
+            metadata.mCapabilities = slot.mCapabilities.load(std::memory_order_relaxed);
+            
+            peers.emplace_back(id, static_cast<uint16_t>(slot.mPort.load(std::memory_order_relaxed)), metadata);
+        }
+        
+        // Forget liveness information for instances that are no longer registered
+        
+        for (auto it = mLiveness.begin(); it != mLiveness.end(); )
+        {
+            if (it->second.mScan != mScan)
+                it = mLiveness.erase(it);
+            else
+                it++;
+        }
+        
+        mSnapshot.Publish(std::move(peers));
+        
+        return mSnapshot.Version();
+    }
+    
+    Snapshot Peers() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        return mSnapshot.Get();
+    }
+    
+    uint64_t Churn() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        return mSnapshot.Churn();
+    }
+    
+private:
+    
+    static uint64_t ServiceKey(const LocalService& service)
+    {
+        return service.InstanceID();
+    }
+    
+    // Only the port identifies a service (metadata changes are passed as updates rather than changes)
+    
+    static bool ServiceChanged(const LocalService& a, const LocalService& b)
+    {
+        return a.Port() != b.Port();
+    }
+    
+    static bool MetadataChanged(const LocalService& a, const LocalService& b)
+    {
+        const BeaconMetadata& m1 = a.Metadata();
+        const BeaconMetadata& m2 = b.Metadata();
+        
+        return m1.mLoad != m2.mLoad || m1.mProtocolVersion != m2.mProtocolVersion || m1.mCapabilities != m2.mCapabilities;
+    }
+    
+    // Shared memory names are limited to 31 characters on macOS (so long names are shortened and hashed)
+    
+    static std::string RegionName(const char* regname)
+    {
+        std::string name = std::string("/") + regname + "-registry-v1";
+        
+        if (name.length() <= sMaxNameLength)
+            return name;
+        
+        // N.B. FNV-1a is used as it is stable across processes and builds (unlike std::hash)
+        
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        char shortened[sMaxNameLength + 1];
+        
+        for (size_t i = 0; i < name.length(); i++)
+            hash = (hash ^ static_cast<uint8_t>(name[i])) * 0x100000001b3ULL;
+        
+        snprintf(shortened, sizeof(shortened), "/%.12s-%016llx", regname, static_cast<unsigned long long>(hash));
+        
+        return shortened;
+    }
+    
+    static int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+    }
+    
+    static bool ProcessExists(int32_t process)
+    {
+        return kill(process, 0) == 0 || errno != ESRCH;
+    }
+    
+    // Take free slots or those left behind by processes that have exited (or whose heartbeat stopped long ago)
+    // N.B. the instance is withdrawn whilst the slot is filled in (so that readers never see a partial slot)
+    
+    bool ClaimSlot(Slot& slot, int32_t process)
+    {
+        int32_t owner = slot.mProcess.load();
+        
+        if (owner && ProcessExists(owner) && Now() - slot.mBeatTime.load() < sReclaimMS)
+            return false;
+        
+        if (!slot.mProcess.compare_exchange_strong(owner, process))
+            return false;
+        
+        slot.mInstanceID.store(0);
+        return true;
+    }
+    
+    void Claim()
+    {
+        const int32_t process = static_cast<int32_t>(getpid());
+        
+        for (int i = 0; i < sNumSlots && !mSlot; i++)
+        {
+            Slot& slot = mRegion->mSlots[i];
+            
+            if (ClaimSlot(slot, process))
+            {
+                slot.mPort.store(static_cast<uint32_t>(mBasePort + i));
+                slot.mLoad.store(0);
+                slot.mBeatTime.store(Now());
+                slot.mHeartbeat.fetch_add(1);
+                slot.mInstanceID.store(mInstanceID, std::memory_order_release);
+                mSlot = &slot;
+                
+                DBGMSG("REGISTRY: Claimed slot %d (port %d)\n", i, mBasePort + i);
+            }
+        }
+    }
+    
+    const uint64_t mInstanceID;
+    const uint16_t mBasePort;
+    
+    Region *mRegion;
+    Slot *mSlot;
+    
+    mutable std::mutex mMutex;
+    std::unordered_map<uint64_t, Liveness> mLiveness;
+    uint64_t mScan;
+    ServiceSnapshot mSnapshot;
+};
+
+#endif /* LOCALREGISTRY_HPP */
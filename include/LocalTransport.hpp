@@ -0,0 +1,691 @@
+
+#ifndef LOCALTRANSPORT_HPP
+#define LOCALTRANSPORT_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "IPlugLogger.h"
+
+#include "NetworkTypes.hpp"
+
+// A same-host transport using Unix domain sockets with length-prefixed messages
+// Servers listen on a socket path derived from their port alongside the websocket server
+// Clients use it in place of the websocket when the server is on the same host
+// Sockets are non-blocking - sends are queued and written by the transport thread when the socket is ready
+
+class LocalTransport
+{
+public:
+    
+    using ConnectionID = ws_connection_id;
+    
+    struct ServerHandlers
+    {
+        void (*mConnect)(ConnectionID, void *);
+        void (*mReady)(ConnectionID, void *);
+        void (*mData)(ConnectionID, const void *, size_t, void *);
+        void (*mClose)(ConnectionID, void *);
+    };
+    
+    struct ClientHandlers
+    {
+        void (*mData)(ConnectionID, const void *, size_t, void *);
+        void (*mClose)(ConnectionID, void *);
+    };
+    
+    static std::string Path(uint16_t port)
+    {
+        const char *directory = getenv("TMPDIR");
+        std::string path(directory && *directory ? directory : "/tmp");
+        
+        if (path.back() != '/')
+            path += "/";
+        
+        return path + "iplug-network-" + std::to_string(port) + ".sock";
+    }
+    
+    static bool IsLoopback(const char* host)
+    {
+        return !strcmp(host, "localhost") || !strcmp(host, "127.0.0.1") || !strcmp(host, "::1");
+    }
+    
+    // Hosts are local if they are loopback addresses or match this host's name (with or without .local.)
+    
+    static bool IsLocalHost(const char* host)
+    {
+        constexpr int maxLength = 256;
+        
+        char name[maxLength];
+        
+        if (IsLoopback(host))
+            return true;
+        
+        if (gethostname(name, maxLength))
+            return false;
+        
+        name[maxLength - 1] = 0;
+        
+        return !strcasecmp(ConformHost(name).c_str(), ConformHost(host).c_str());
+    }
+    
+protected:
+    
+    static constexpr uint32_t sMaxMessage = 1 << 24;
+    static constexpr size_t sMaxQueued = 1 << 26;
+    static constexpr int sReadSize = 65536;
+    static constexpr uint64_t sLocalConnection = 1ULL << 63;
+    
+    static std::string ConformHost(const char* host)
+    {
+        std::string conformed(host);
+        std::string local(".local");
+        
+        if (!conformed.empty() && conformed.back() == '.')
+            conformed.pop_back();
+        
+        if (conformed.length() > local.length() && !strcasecmp(conformed.c_str() + conformed.length() - local.length(), local.c_str()))
+            conformed.resize(conformed.length() - local.length());
+        
+        return conformed;
+    }
+    
+    static sockaddr_un Address(uint16_t port)
+    {
+        sockaddr_un address {};
+        std::string path = Path(port);
+        
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        
+        return address;
+    }
+    
+    static int OpenSocket()
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        
+        if (fd >= 0)
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        return fd;
+    }
+    
+    static bool SetNonBlocking(int fd)
+    {
+        int flags = fcntl(fd, F_GETFL, 0);
+        
+        return flags >= 0 && !fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    
+    // Connection IDs are never reused (and are kept apart from websocket IDs by the top bit)
+    
+    static ConnectionID NextID()
+    {
+        static std::atomic<uint64_t> next(0);
+        
+        return static_cast<ConnectionID>(sLocalConnection | ++next);
+    }
+    
+    // Outbound messages for a socket (queued by senders under a mutex and written only by the transport thread)
+    
+    struct Output
+    {
+        // Queue a length-prefixed message (returning true if the transport thread needs waking)
+        // N.B. a full queue fails the connection (as dropping a message would break the stream)
+        
+        bool Queue(const void* data, size_t size)
+        {
+            uint32_t length = static_cast<uint32_t>(size);
+            auto bytes = static_cast<const uint8_t *>(data);
+            bool wake = mQueued.empty();
+            
+            if (mFailed)
+                return false;
+            
+            if (mQueued.size() + sizeof(length) + size > sMaxQueued)
+            {
+                DBGMSG("LOCAL: Peer too far behind - disconnecting\n");
+                mFailed = true;
+                return true;
+            }
+            
+            mQueued.insert(mQueued.end(), reinterpret_cast<const uint8_t *>(&length), reinterpret_cast<const uint8_t *>(&length) + sizeof(length));
+            mQueued.insert(mQueued.end(), bytes, bytes + size);
+            
+            return wake;
+        }
+        
+        std::vector<uint8_t> mQueued;
+        std::vector<uint8_t> mWriting;
+        size_t mWritten = 0;
+        bool mFailed = false;
+    };
+    
+    // Write what the socket will take without blocking (returns false on error)
+    // N.B. queued messages are taken under the mutex but written without it
+    
+    static bool Flush(int fd, Output& output, std::mutex& mutex)
+    {
+#ifdef MSG_NOSIGNAL
+        constexpr int flags = MSG_NOSIGNAL;
+#else
+        constexpr int flags = 0;
+#endif
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            
+            if (output.mFailed)
+                return false;
+            
+            if (output.mWritten == output.mWriting.size())
+            {
+                output.mWriting.clear();
+                output.mWriting.swap(output.mQueued);
+                output.mWritten = 0;
+            }
+        }
+        
+        while (output.mWritten < output.mWriting.size())
+        {
+            ssize_t written = send(fd, output.mWriting.data() + output.mWritten, output.mWriting.size() - output.mWritten, flags);
+            
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            
+            output.mWritten += static_cast<size_t>(written);
+        }
+        
+        return true;
+    }
+    
+    // Output is pending if any is being written or queued (the latter must be checked under the mutex)
+    
+    static bool IsPending(const Output& output)
+    {
+        return output.mWritten < output.mWriting.size() || output.mQueued.size() || output.mFailed;
+    }
+    
+    // Read what is available and pass on each complete message (returns false on close or error)
+    // N.B. only partial messages are kept in the buffer (complete messages are passed on directly)
+    
+    template <class Handler>
+    static bool Read(int fd, std::vector<uint8_t>& buffer, Handler&& handler)
+    {
+        uint8_t data[sReadSize];
+        
+        ssize_t size = recv(fd, data, sReadSize, 0);
+        
+        if (size <= 0)
+            return size < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK);
+        
+        const uint8_t *read = data;
+        size_t available = static_cast<size_t>(size);
+        
+        if (buffer.size())
+        {
+            buffer.insert(buffer.end(), data, data + size);
+            read = buffer.data();
+            available = buffer.size();
+        }
+        
+        size_t position = 0;
+        uint32_t length = 0;
+        
+        while (available - position >= sizeof(length))
+        {
+            memcpy(&length, read + position, sizeof(length));
+            
+            if (length > sMaxMessage)
+                return false;
+            
+            if (available - position - sizeof(length) < length)
+                break;
+            
+            handler(read + position + sizeof(length), static_cast<size_t>(length));
+            position += sizeof(length) + length;
+        }
+        
+        if (read == data)
+            buffer.assign(data + position, data + available);
+        else
+            buffer.erase(buffer.begin(), buffer.begin() + position);
+        
+        return true;
+    }
+    
+    // A pipe used to wake the transport thread (for shutdown or to write queued messages)
+    // N.B. both ends are non-blocking (a full pipe already wakes the thread)
+    
+    class Wake
+    {
+    public:
+        
+        Wake()
+        {
+            if (pipe(mFDs))
+                mFDs[0] = mFDs[1] = -1;
+            else
+            {
+                SetNonBlocking(mFDs[0]);
+                SetNonBlocking(mFDs[1]);
+            }
+        }
+        
+        ~Wake()
+        {
+            if (mFDs[0] >= 0)
+            {
+                close(mFDs[0]);
+                close(mFDs[1]);
+            }
+        }
+        
+        Wake(const Wake&) = delete;
+        Wake& operator=(const Wake&) = delete;
+        
+        int Descriptor() const { return mFDs[0]; }
+        
+        void Signal()
+        {
+            uint8_t byte = 0;
+            
+            if (write(mFDs[1], &byte, 1) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                DBGMSG("LOCAL: Could not wake thread\n");
+        }
+        
+        void Drain()
+        {
+            uint8_t bytes[64];
+            
+            while (read(mFDs[0], bytes, sizeof(bytes)) > 0)
+                continue;
+        }
+        
+    private:
+        
+        int mFDs[2];
+    };
+};
+
+// A local server that accepts connections on the socket path for a port
+// N.B. a client that falls too far behind is disconnected (rather than holding up the server or other clients)
+
+class LocalServer : public LocalTransport
+{
+    struct Connection
+    {
+        Connection(int fd) : mSocket(fd), mID(NextID()) {}
+        
+        int mSocket;
+        ConnectionID mID;
+        std::vector<uint8_t> mBuffer;
+        Output mOutput;
+    };
+    
+public:
+    
+    using Handlers = ServerHandlers;
+    
+    // N.B. an existing socket file is removed so the caller must own the port (the websocket server has bound it)
+    
+    static LocalServer* Create(uint16_t port, const Handlers& handlers, void* owner)
+    {
+        sockaddr_un address = Address(port);
+        
+        int fd = OpenSocket();
+        
+        if (fd < 0)
+            return nullptr;
+        
+        unlink(address.sun_path);
+        
+        if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) || listen(fd, 16))
+        {
+            DBGMSG("LOCAL: Could not listen on %s\n", address.sun_path);
+            close(fd);
+            return nullptr;
+        }
+        
+        return new LocalServer(fd, address, handlers, owner);
+    }
+    
+    ~LocalServer()
+    {
+        mActive = false;
+        mWake.Signal();
+        mThread.join();
+        
+        for (auto it = mConnections.begin(); it != mConnections.end(); it++)
+            close(it->mSocket);
+        
+        close(mSocket);
+        unlink(mAddress.sun_path);
+    }
+    
+    LocalServer(const LocalServer&) = delete;
+    LocalServer& operator=(const LocalServer&) = delete;
+    
+    size_t Size() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        return mConnections.size();
+    }
+    
+    bool Has(ConnectionID id) const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        for (auto it = mConnections.begin(); it != mConnections.end(); it++)
+        {
+            if (it->mID == id)
+                return true;
+        }
+        
+        return false;
+    }
+    
+    void Send(ConnectionID id, const void* data, size_t size)
+    {
+        bool wake = false;
+        
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            
+            for (auto it = mConnections.begin(); it != mConnections.end(); it++)
+            {
+                if (it->mID == id)
+                    wake = it->mOutput.Queue(data, size);
+            }
+        }
+        
+        if (wake)
+            mWake.Signal();
+    }
+    
+    void Send(const void* data, size_t size)
+    {
+        bool wake = false;
+        
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            
+            for (auto it = mConnections.begin(); it != mConnections.end(); it++)
+                wake = it->mOutput.Queue(data, size) || wake;
+        }
+        
+        if (wake)
+            mWake.Signal();
+    }
+    
+private:
+    
+    LocalServer(int fd, const sockaddr_un& address, const Handlers& handlers, void* owner)
+    : mSocket(fd)
+    , mAddress(address)
+    , mHandlers(handlers)
+    , mOwner(owner)
+    , mActive(true)
+    , mThread([this]() { Run(); })
+    {}
+    
+    // N.B. the list is only modified on the server thread so it may be iterated here without the mutex
+    
+    void Run()
+    {
+        std::vector<pollfd> descriptors;
+        
+        while (mActive)
+        {
+            descriptors.clear();
+            descriptors.push_back({ mWake.Descriptor(), POLLIN, 0 });
+            descriptors.push_back({ mSocket, POLLIN, 0 });
+            
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                
+                for (auto it = mConnections.begin(); it != mConnections.end(); it++)
+                    descriptors.push_back({ it->mSocket, static_cast<short>(POLLIN | (IsPending(it->mOutput) ? POLLOUT : 0)), 0 });
+            }
+            
+            if (poll(descriptors.data(), static_cast<nfds_t>(descriptors.size()), -1) <= 0)
+                continue;
+            
+            if (descriptors[0].revents)
+                mWake.Drain();
+            
+            if (!mActive)
+                break;
+            
+            // Queued messages are written as soon as they are signalled (and otherwise when the socket has room)
+            
+            auto it = mConnections.begin();
+            
+            for (size_t i = 2; i < descriptors.size(); i++)
+            {
+                auto connection = it++;
+                
+                bool write = (descriptors[i].revents & POLLOUT) || descriptors[0].revents;
+                bool read = descriptors[i].revents & ~POLLOUT;
+                
+                if ((write && !Flush(connection->mSocket, connection->mOutput, mMutex)) || (read && !Receive(*connection)))
+                    Close(connection);
+            }
+            
+            if (descriptors[1].revents & POLLIN)
+                Accept();
+        }
+    }
+    
+    void Accept()
+    {
+        int fd = accept(mSocket, nullptr, nullptr);
+        
+        if (fd < 0)
+            return;
+
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        if (!SetNonBlocking(fd))
+        {
+            close(fd);
+            return;
+        }
+        
+        ConnectionID id;
+        
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            
+            mConnections.emplace_back(fd);
+            id = mConnections.back().mID;
+        }
+        
+        mHandlers.mConnect(id, mOwner);
+        mHandlers.mReady(id, mOwner);
+    }
+    
+    bool Receive(Connection& connection)
+    {
+        ConnectionID id = connection.mID;
+        
+        auto handler = [&](const void* data, size_t size) { mHandlers.mData(id, data, size, mOwner); };
+        
+        return Read(connection.mSocket, connection.mBuffer, handler);
+    }
+    
+    void Close(std::list<Connection>::iterator it)
+    {
+        ConnectionID id = it->mID;
+        
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            
+            close(it->mSocket);
+            mConnections.erase(it);
+        }
+        
+        mHandlers.mClose(id, mOwner);
+    }
+    
+    int mSocket;
+    sockaddr_un mAddress;
+    Handlers mHandlers;
+    void *mOwner;
+    
+    mutable std::mutex mMutex;
+    std::list<Connection> mConnections;
+    
+    Wake mWake;
+    std::atomic<bool> mActive;
+    std::thread mThread;
+};
+
+// A local client connected to the socket path for a port
+
+class LocalClient : public LocalTransport
+{
+public:
+    
+    using Handlers = ClientHandlers;
+    
+    static LocalClient* Create(uint16_t port, const Handlers& handlers, void* owner)
+    {
+        sockaddr_un address = Address(port);
+        
+        int fd = OpenSocket();
+        
+        if (fd < 0)
+            return nullptr;
+        
+        if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) || !SetNonBlocking(fd))
+        {
+            close(fd);
+            return nullptr;
+        }
+        
+        return new LocalClient(fd, handlers, owner);
+    }
+    
+    // N.B. the client may be deleted from its own close handler (in which case the thread is detached)
+    
+    ~LocalClient()
+    {
+        mActive = false;
+        mWake.Signal();
+        
+        if (mThread.get_id() == std::this_thread::get_id())
+            mThread.detach();
+        else
+            mThread.join();
+        
+        close(mSocket);
+    }
+    
+    LocalClient(const LocalClient&) = delete;
+    LocalClient& operator=(const LocalClient&) = delete;
+    
+    void Send(const void* data, size_t size)
+    {
+        bool wake = false;
+        
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            
+            wake = mOutput.Queue(data, size);
+        }
+        
+        if (wake)
+            mWake.Signal();
+    }
+    
+private:
+    
+    LocalClient(int fd, const Handlers& handlers, void* owner)
+    : mSocket(fd)
+    , mHandlers(handlers)
+    , mOwner(owner)
+    , mActive(true)
+    , mThread([this]() { Run(); })
+    {}
+    
+    void Run()
+    {
+        auto handler = [&](const void* data, size_t size) { mHandlers.mData(ConnectionID(), data, size, mOwner); };
+        
+        while (mActive)
+        {
+            pollfd descriptors[2] = { { mWake.Descriptor(), POLLIN, 0 }, { mSocket, POLLIN, 0 } };
+            
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                
+                if (IsPending(mOutput))
+                    descriptors[1].events |= POLLOUT;
+            }
+            
+            if (poll(descriptors, 2, -1) <= 0)
+                continue;
+            
+            if (descriptors[0].revents)
+                mWake.Drain();
+            
+            if (!mActive)
+                break;
+            
+            bool write = (descriptors[1].revents & POLLOUT) || descriptors[0].revents;
+            bool read = descriptors[1].revents & ~POLLOUT;
+            
+            if ((write && !Flush(mSocket, mOutput, mMutex)) || (read && !Read(mSocket, mBuffer, handler)))
+            {
+                // N.B. nothing may be touched after the close handler as it may delete the client
+                
+                auto close = mHandlers.mClose;
+                void *owner = mOwner;
+                
+                close(ConnectionID(), owner);
+                return;
+            }
+        }
+    }
+    
+    int mSocket;
+    Handlers mHandlers;
+    void *mOwner;
+    
+    std::mutex mMutex;
+    std::vector<uint8_t> mBuffer;
+    Output mOutput;
+    
+    Wake mWake;
+    std::atomic<bool> mActive;
+    std::thread mThread;
+};
+
+#endif /* LOCALTRANSPORT_HPP */
@@ -0,0 +1,374 @@
+
+#ifndef LOCKINSTRUMENTATION_HPP
+#define LOCKINSTRUMENTATION_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../dependencies/websocket-tools/websocket-tools.hpp"
+
+// Per-site lock statistics (used when NETWORK_LOCK_INSTRUMENTATION is defined)
+// Sites are identified by the file and line at which a lock is taken
+// Each site records acquisitions, a histogram of wait times and the total and maximum hold times
+
+class LockStats
+{
+    static constexpr int sNumSites = 512;
+    
+public:
+    
+    // Wait buckets are < 1us, then doubling from 1us (the last bucket holds everything longer)
+    
+    static constexpr int sNumBuckets = 24;
+    
+    struct Site
+    {
+        std::atomic<uint64_t> mKey;
+        std::atomic<const char *> mFile;
+        std::atomic<int> mLine;
+        std::atomic<const char *> mKind;
+        
+        std::atomic<uint64_t> mAcquisitions;
+        std::atomic<uint64_t> mPromotions;
+        std::atomic<uint64_t> mWaitNS;
+        std::atomic<uint64_t> mMaxWaitNS;
+        std::atomic<uint64_t> mHoldNS;
+        std::atomic<uint64_t> mMaxHoldNS;
+        std::atomic<uint64_t> mWaits[sNumBuckets];
+        
+        void RecordWait(uint64_t ns, bool promotion)
+        {
+            if (promotion)
+                mPromotions++;
+            else
+                mAcquisitions++;
+            
+            mWaitNS += ns;
+            mWaits[Bucket(ns)]++;
+            Max(mMaxWaitNS, ns);
+        }
+        
+        void RecordHold(uint64_t ns)
+        {
+            mHoldNS += ns;
+            Max(mMaxHoldNS, ns);
+        }
+    };
+    
+    static uint64_t Now()
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+    }
+    
+    // Find (or claim) the site for a given location (without locking)
+    
+    static Site* Find(const char* file, int line, const char* kind)
+    {
+        uint64_t key = Key(file, line, kind);
+        
+        for (int i = 0; i < sNumSites; i++)
+        {
+            Site& site = Sites()[(key + i) % sNumSites];
+            uint64_t current = site.mKey.load();
+            
+            if (!current && site.mKey.compare_exchange_strong(current, key))
+            {
+                site.mLine = line;
+                site.mKind = kind;
+                site.mFile = file;
+                return &site;
+            }
+            
+            if (current == key)
+                return &site;
+        }
+        
+        return &Overflow();
+    }
+    
+    static void Reset()
+    {
+        for (int i = 0; i < sNumSites; i++)
+            Clear(Sites()[i]);
+        
+        Clear(Overflow());
+    }
+    
+    // A report of all sites ordered by total wait time
+    
+    static std::string Report()
+    {
+        std::vector<Site *> sites;
+        std::string report;
+        char line[512];
+        
+        for (int i = 0; i < sNumSites; i++)
+        {
+            if (Sites()[i].mFile.load() && (Sites()[i].mAcquisitions || Sites()[i].mPromotions))
+                sites.push_back(&Sites()[i]);
+        }
+        
+        if (Overflow().mAcquisitions)
+            sites.push_back(&Overflow());
+        
+        std::sort(sites.begin(), sites.end(), [](const Site* a, const Site* b) { return a->mWaitNS > b->mWaitNS; });
+        
+        for (auto it = sites.begin(); it != sites.end(); it++)
+        {
+            const Site& site = **it;
+            const char *file = site.mFile.load() ? site.mFile.load() : "(overflow)";
+            const char *name = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
+            uint64_t count = std::max<uint64_t>(1, site.mAcquisitions);
+            
+            snprintf(line, sizeof(line), "%s:%d [%s] acquired %llu promoted %llu wait %.3f ms (max %.3f us) hold %.3f ms (mean %.3f us max %.3f us)\n",
+                     name, site.mLine.load(), site.mKind.load() ? site.mKind.load() : "",
+                     static_cast<unsigned long long>(site.mAcquisitions.load()),
+                     static_cast<unsigned long long>(site.mPromotions.load()),
+                     site.mWaitNS / 1e6, site.mMaxWaitNS / 1e3,
+                     site.mHoldNS / 1e6, site.mHoldNS / 1e3 / count, site.mMaxHoldNS / 1e3);
+            
+            report += line;
+            report += "    waits:";
+            
+            for (int i = 0; i < sNumBuckets; i++)
+            {
+                if (site.mWaits[i])
+                {
+                    const char *bound = i == sNumBuckets - 1 ? ">=" : "<";
+                    unsigned long long us = i == sNumBuckets - 1 ? 1ULL << (i - 1) : 1ULL << i;
+                    
+                    snprintf(line, sizeof(line), " %s%lluus:%llu", bound, us, static_cast<unsigned long long>(site.mWaits[i].load()));
+                    report += line;
+                }
+            }
+            
+            report += "\n";
+        }
+        
+        return report;
+    }
+    
+    static void Dump(FILE* file = stdout)
+    {
+        fputs(Report().c_str(), file);
+        fflush(file);
+    }
+    
+private:
+    
+    static Site* Sites()
+    {
+        static Site sites[sNumSites] = {};
+        return sites;
+    }
+    
+    static Site& Overflow()
+    {
+        static Site site = {};
+        return site;
+    }
+    
+    // An FNV-1a hash of the location and kind (computed without allocating)
+    
+    static uint64_t Key(const char* file, int line, const char* kind)
+    {
+        uint64_t key = 14695981039346656037ULL;
+        
+        auto add = [&](const char* str)
+        {
+            for (; *str; str++)
+                key = (key ^ static_cast<uint8_t>(*str)) * 1099511628211ULL;
+        };
+        
+        add(file);
+        add(kind);
+        key = (key ^ static_cast<uint64_t>(line)) * 1099511628211ULL;
+        
+        return key ? key : 1;
+    }
+    
+    static int Bucket(uint64_t ns)
+    {
+        int bucket = 0;
+        
+        for (uint64_t us = ns / 1000; us && bucket < sNumBuckets - 1; us >>= 1)
+            bucket++;
+        
+        return bucket;
+    }
+    
+    static void Max(std::atomic<uint64_t>& max, uint64_t value)
+    {
+        uint64_t current = max.load();
+        
+        while (value > current && !max.compare_exchange_weak(current, value));
+    }
+    
+    static void Clear(Site& site)
+    {
+        site.mAcquisitions = 0;
+        site.mPromotions = 0;
+        site.mWaitNS = 0;
+        site.mMaxWaitNS = 0;
+        site.mHoldNS = 0;
+        site.mMaxHoldNS = 0;
+        
+        for (int i = 0; i < sNumBuckets; i++)
+            site.mWaits[i] = 0;
+    }
+};
+
+// Timing for a single lock acquisition at a site
+
+class LockTiming
+{
+public:
+    
+    LockTiming(const char* file, int line, const char* kind)
+    : mSite(LockStats::Find(file, line, kind))
+    , mStart(0)
+    , mAcquired(0)
+    {}
+    
+    void Acquire()
+    {
+        mStart = LockStats::Now();
+    }
+    
+    void Acquired()
+    {
+        mAcquired = LockStats::Now();
+        mSite->RecordWait(mAcquired - mStart, false);
+    }
+    
+    // Promotions are recorded as waits within the hold time of the original acquisition
+    
+    void Promoted()
+    {
+        mSite->RecordWait(LockStats::Now() - mStart, true);
+    }
+    
+    void Released()
+    {
+        mSite->RecordHold(LockStats::Now() - mAcquired);
+    }
+    
+private:
+    
+    LockStats::Site *mSite;
+    uint64_t mStart;
+    uint64_t mAcquired;
+};
+
+// Instrumented equivalents of the WDL scoped locks (the call site is captured by default arguments)
+
+class InstrumentedRecursiveLock
+{
+public:
+    
+    InstrumentedRecursiveLock(WDL_Mutex* mutex, const char* file = __builtin_FILE(), int line = __builtin_LINE())
+    : mMutex(mutex)
+    , mTiming(file, line, "recursive")
+    {
+        if (mMutex)
+        {
+            mTiming.Acquire();
+            mMutex->Enter();
+            mTiming.Acquired();
+        }
+    }
+    
+    ~InstrumentedRecursiveLock()
+    {
+        if (mMutex)
+        {
+            mTiming.Released();
+            mMutex->Leave();
+        }
+    }
+    
+    InstrumentedRecursiveLock(const InstrumentedRecursiveLock&) = delete;
+    InstrumentedRecursiveLock& operator=(const InstrumentedRecursiveLock&) = delete;
+    
+private:
+    
+    WDL_Mutex *mMutex;
+    LockTiming mTiming;
+};
+
+class InstrumentedSharedLock
+{
+public:
+    
+    InstrumentedSharedLock(WDL_SharedMutex* mutex, const char* file = __builtin_FILE(), int line = __builtin_LINE())
+    : mMutex(mutex)
+    , mTiming(file, line, "shared")
+    {
+        if (mMutex)
+        {
+            mTiming.Acquire();
+            mMutex->LockShared();
+            mTiming.Acquired();
+        }
+    }
+    
+    ~InstrumentedSharedLock()
+    {
+        if (mMutex)
+        {
+            mTiming.Released();
+            mMutex->UnlockShared();
+        }
+    }
+    
+    InstrumentedSharedLock(const InstrumentedSharedLock&) = delete;
+    InstrumentedSharedLock& operator=(const InstrumentedSharedLock&) = delete;
+    
+private:
+    
+    WDL_SharedMutex *mMutex;
+    LockTiming mTiming;
+};
+
+class InstrumentedExclusiveLock
+{
+public:
+    
+    InstrumentedExclusiveLock(WDL_SharedMutex* mutex, const char* file = __builtin_FILE(), int line = __builtin_LINE())
+    : mMutex(mutex)
+    , mTiming(file, line, "exclusive")
+    {
+        if (mMutex)
+        {
+            mTiming.Acquire();
+            mMutex->LockExclusive();
+            mTiming.Acquired();
+        }
+    }
+    
+    ~InstrumentedExclusiveLock()
+    {
+        if (mMutex)
+        {
+            mTiming.Released();
+            mMutex->UnlockExclusive();
+        }
+    }
+    
+    InstrumentedExclusiveLock(const InstrumentedExclusiveLock&) = delete;
+    InstrumentedExclusiveLock& operator=(const InstrumentedExclusiveLock&) = delete;
+    
+private:
+    
+    WDL_SharedMutex *mMutex;
+    LockTiming mTiming;
+};
+
+#endif /* LOCKINSTRUMENTATION_HPP */
@@ -0,0 +1,350 @@
+
+#ifndef NETWORKCAPTURE_HPP
+#define NETWORKCAPTURE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../dependencies/websocket-tools/websocket-tools.hpp"
+
+// Capture of the inbound events of servers and clients to a compact binary file (for replay with NetworkReplay)
+// The file is a header followed by records of a kind byte then varints for the time since the previous record,
+// the connection (server events only) and the size (followed by the bytes) for data events
+// Connections are numbered in order of first appearance
+
+class NetworkCapture
+{
+    static constexpr char sMagic[8] = { 'N', 'W', 'C', 'A', 'P', 1, 0, 0 };
+    
+public:
+    
+    enum class Kind : uint8_t { ServerReady, ServerData, ServerClose, ClientData, ClientClose };
+    
+    NetworkCapture(const char* path)
+    : mFile(fopen(path, "wb"))
+    , mLastTime(Now())
+    , mNextConnection(0)
+    {
+        if (mFile)
+            fwrite(sMagic, 1, sizeof(sMagic), mFile);
+    }
+    
+    ~NetworkCapture()
+    {
+        if (mFile)
+            fclose(mFile);
+    }
+    
+    NetworkCapture(const NetworkCapture&) = delete;
+    NetworkCapture& operator=(const NetworkCapture&) = delete;
+    
+    bool IsOpen() const { return mFile; }
+    
+    template <class ConnectionID>
+    void Server(Kind kind, const ConnectionID& id, const void* data = nullptr, size_t size = 0)
+    {
+        Record(kind, std::hash<ConnectionID>()(id), data, size);
+    }
+    
+    void Client(Kind kind, const void* data = nullptr, size_t size = 0)
+    {
+        Record(kind, 0, data, size);
+    }
+    
+    void Flush()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        if (mFile)
+            fflush(mFile);
+    }
+    
+    static bool IsServer(Kind kind) { return kind <= Kind::ServerClose; }
+    static bool IsData(Kind kind) { return kind == Kind::ServerData || kind == Kind::ClientData; }
+    
+    static bool CheckMagic(const char* magic) { return !memcmp(magic, sMagic, sizeof(sMagic)); }
+    static constexpr size_t MagicSize() { return sizeof(sMagic); }
+    
+private:
+    
+    static uint64_t Now()
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+    }
+    
+    void Record(Kind kind, size_t key, const void* data, size_t size)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        if (!mFile)
+            return;
+        
+        uint64_t time = Now();
+        
+        fputc(static_cast<int>(kind), mFile);
+        PutVarint(time - mLastTime);
+        mLastTime = time;
+        
+        if (IsServer(kind))
+        {
+            auto it = mConnections.find(key);
+            
+            if (it == mConnections.end())
+                it = mConnections.emplace(key, mNextConnection++).first;
+            
+            PutVarint(it->second);
+            
+            // N.B. closed connections are renumbered if the transport reuses their IDs
+            
+            if (kind == Kind::ServerClose)
+                mConnections.erase(it);
+        }
+        
+        if (IsData(kind))
+        {
+            PutVarint(size);
+            fwrite(data, 1, size, mFile);
+        }
+    }
+    
+    void PutVarint(uint64_t value)
+    {
+        for (; value >= 0x80; value >>= 7)
+            fputc(static_cast<int>((value & 0x7F) | 0x80), mFile);
+        
+        fputc(static_cast<int>(value), mFile);
+    }
+    
+    std::mutex mMutex;
+    FILE *mFile;
+    uint64_t mLastTime;
+    uint64_t mNextConnection;
+    std::unordered_map<size_t, uint64_t> mConnections;
+};
+
+// Replay of a capture into a server and / or client (at the recorded speed scaled by a factor or as fast as possible)
+// Events are passed directly to the handlers (so no sockets are involved) and the handler CPU time is measured
+// N.B. server events are refused whilst the server is running (refused events are counted but not timed)
+
+class NetworkReplay
+{
+    static constexpr uint64_t sMaxFrame = 1 << 26;
+    static constexpr uint64_t sReplayConnection = 1ULL << 62;
+    
+public:
+    
+    struct Frame
+    {
+        NetworkCapture::Kind mKind;
+        uint64_t mDelta;
+        uint64_t mConnection;
+        std::vector<uint8_t> mData;
+    };
+    
+    struct Result
+    {
+        size_t mFrames = 0;
+        size_t mRefused = 0;
+        uint64_t mBytes = 0;
+        double mWallTime = 0.0;
+        double mHandlerTime = 0.0;
+    };
+    
+    // The whole capture is loaded up front so that file access is not measured
+    
+    NetworkReplay(const char* path)
+    : mValid(false)
+    {
+        if (FILE* file = fopen(path, "rb"))
+        {
+            mValid = Load(file);
+            fclose(file);
+        }
+    }
+    
+    bool IsValid() const { return mValid; }
+    size_t NumFrames() const { return mFrames.size(); }
+    
+    // A speed of zero replays as fast as possible (otherwise recorded gaps are divided by the speed)
+    
+    template <class Server>
+    Result RunServer(Server& server, double speed = 1.0)
+    {
+        return Play(speed, [&](const Frame& frame) { return Dispatch(server, frame); }, nullptr);
+    }
+    
+    template <class Client>
+    Result RunClient(Client& client, double speed = 1.0)
+    {
+        return Play(speed, nullptr, [&](const Frame& frame) { return Replay(client, frame); });
+    }
+    
+    template <class Peer>
+    Result Run(Peer& peer, double speed = 1.0)
+    {
+        auto server = [&](const Frame& frame) { return Dispatch(peer, frame); };
+        auto client = [&](const Frame& frame) { return Replay(peer, frame); };
+        
+        return Play(speed, server, client);
+    }
+    
+private:
+    
+    using Handler = std::function<bool(const Frame&)>;
+    
+    // Replayed connections are given IDs in their own range in order of first appearance
+    // N.B. connection numbers are looked up (so that a large number in a capture does not allocate for every smaller one)
+    
+    template <class Server>
+    bool Dispatch(Server& server, const Frame& frame)
+    {
+        auto it = mConnections.find(frame.mConnection);
+        
+        if (it == mConnections.end())
+            it = mConnections.emplace(frame.mConnection, static_cast<ws_connection_id>(sReplayConnection + mConnections.size())).first;
+        
+        return server.ReplayServerEvent(frame.mKind, it->second, frame.mData.data(), frame.mData.size());
+    }
+    
+    template <class Client>
+    static bool Replay(Client& client, const Frame& frame)
+    {
+        client.ReplayClientEvent(frame.mKind, frame.mData.data(), frame.mData.size());
+        
+        return true;
+    }
+    
+    Result Play(double speed, Handler server, Handler client)
+    {
+        using Clock = std::chrono::steady_clock;
+        
+        Result result;
+        auto start = Clock::now();
+        auto due = start;
+        
+        for (auto it = mFrames.begin(); it != mFrames.end(); it++)
+        {
+            const Handler& handler = NetworkCapture::IsServer(it->mKind) ? server : client;
+            
+            if (speed > 0.0)
+            {
+                due += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::micro>(it->mDelta / speed));
+                std::this_thread::sleep_until(due);
+            }
+            
+            if (!handler)
+                continue;
+            
+            double cpu = ThreadTime();
+            
+            if (!handler(*it))
+            {
+                result.mRefused++;
+                continue;
+            }
+            
+            result.mHandlerTime += ThreadTime() - cpu;
+            result.mFrames++;
+            result.mBytes += it->mData.size();
+        }
+        
+        result.mWallTime = std::chrono::duration<double>(Clock::now() - start).count();
+        
+        return result;
+    }
+    
+    static double ThreadTime()
+    {
+        timespec time;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+        
+        return time.tv_sec + time.tv_nsec * 1e-9;
+    }
+    
+    // Data sizes are checked against the rest of the file (and a maximum) before anything is allocated
+    
+    bool Load(FILE* file)
+    {
+        char magic[NetworkCapture::MagicSize()];
+        
+        if (fseek(file, 0, SEEK_END))
+            return false;
+        
+        long length = ftell(file);
+        
+        if (length < 0 || fseek(file, 0, SEEK_SET))
+            return false;
+        
+        if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || !NetworkCapture::CheckMagic(magic))
+            return false;
+        
+        for (int kind = fgetc(file); kind != EOF; kind = fgetc(file))
+        {
+            Frame frame;
+            
+            if (kind > static_cast<int>(NetworkCapture::Kind::ClientClose))
+                return false;
+            
+            frame.mKind = static_cast<NetworkCapture::Kind>(kind);
+            frame.mConnection = 0;
+            
+            if (!GetVarint(file, frame.mDelta))
+                return false;
+            
+            if (NetworkCapture::IsServer(frame.mKind) && !GetVarint(file, frame.mConnection))
+                return false;
+            
+            if (NetworkCapture::IsData(frame.mKind))
+            {
+                uint64_t size = 0;
+                
+                if (!GetVarint(file, size) || size > sMaxFrame || size > static_cast<uint64_t>(length - ftell(file)))
+                    return false;
+                
+                frame.mData.resize(size);
+                
+                if (fread(frame.mData.data(), 1, size, file) != size)
+                    return false;
+            }
+            
+            mFrames.push_back(std::move(frame));
+        }
+        
+        return true;
+    }
+    
+    static bool GetVarint(FILE* file, uint64_t& value)
+    {
+        value = 0;
+        
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            int byte = fgetc(file);
+            
+            if (byte == EOF)
+                return false;
+            
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            
+            if (!(byte & 0x80))
+                return true;
+        }
+        
+        return false;
+    }
+    
+    bool mValid;
+    std::vector<Frame> mFrames;
+    std::unordered_map<uint64_t, ws_connection_id> mConnections;
+};
+
+#endif /* NETWORKCAPTURE_HPP */
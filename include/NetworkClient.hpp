@@ -2,23 +2,41 @@
 #ifndef NETWORKCLIENT_HPP
 #define NETWORKCLIENT_HPP
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <vector>
 
 #include "IPlugLogger.h"
 #include "IPlugStructs.h"
 
+#include "LocalTransport.hpp"
+#include "NetworkCapture.hpp"
+#include "NetworkData.hpp"
 #include "NetworkTypes.hpp"
 
 // A generic web socket network client that requires an interface for the specifics of the networking
+// Servers on the same host are connected through the local transport where available (unless disabled)
+// The lock types (and whether transport events are deferred to Dispatch()) are taken from the Types policy
 
-template <class T>
-class NetworkClientInterface : protected NetworkTypes
+template <class T, class Types = NetworkTypes>
+class NetworkClientInterface : protected Types
 {
+protected:
+    
+    using typename Types::ConnectionID;
+    using typename Types::RecursiveMutex;
+    using typename Types::RecursiveLock;
+    using typename Types::SharedMutex;
+    using typename Types::SharedLock;
+    using typename Types::VariableLock;
+    
 public:
     
     // Creation and Deletion
     
-    NetworkClientInterface() : mConnection(nullptr), mPort(0) {}
+    NetworkClientInterface() : mConnection(nullptr), mPort(0), mLocalConnection(nullptr), mUseLocal(true), mCapture(nullptr) {}
     virtual ~NetworkClientInterface() {}
     
     NetworkClientInterface(const NetworkClientInterface&) = delete;
@@ -31,14 +49,23 @@ public:
         DBGMSG("CLIENT: Connection attempt: %s \n", host);
         
         static constexpr ws_client_handlers handlers { DoDataClient, DoCloseClient };
-        auto client = T::create(host, port, "/ws", ws_client_owner<handlers>{ this });
+        static constexpr LocalClient::Handlers localHandlers { DoDataClient, DoCloseClient };
+        
+        bool local = mUseLocal && LocalTransport::IsLocalHost(host);
+        
+        auto localClient = local ? LocalClient::Create(port, localHandlers, this) : nullptr;
+        auto client = localClient ? nullptr : T::create(host, port, "/ws", ws_client_owner<handlers>{ this });
         
         VariableLock lock(&mMutex, false);
         
         std::unique_ptr<T> release(mConnection);
+        std::unique_ptr<LocalClient> releaseLocal(mLocalConnection);
         mConnection = client;
+        mLocalConnection = localClient;
+        mEncoder.Reset();
+        mDecoder.Reset();
         
-        if (client)
+        if (client || localClient)
         {
             DBGMSG("CLIENT: Connection successful\n");
             mServer.Set(host);
@@ -61,7 +88,21 @@ public:
         HandleClose();
     }
     
-    void SendDataFromClient(const iplug::IByteChunk& chunk)
+    // Enable or disable the local transport for subsequent connections
+    
+    void SetLocalTransport(bool use)
+    {
+        mUseLocal = use;
+    }
+    
+    bool IsLocalConnection() const
+    {
+        SharedLock lock(&mMutex);
+        
+        return mLocalConnection;
+    }
+    
+    bool SendDataFromClient(const iplug::IByteChunk& chunk)
     {
         SharedLock lock(&mMutex);
         
@@ -71,13 +112,34 @@ public:
             
             mConnection->send(chunk.GetData(), chunk.Size());
         }
+        else if (mLocalConnection)
+            mLocalConnection->Send(chunk.GetData(), chunk.Size());
+        
+        return mConnection || mLocalConnection;
+    }
+    
+    // Send a message with its strings encoded by the connection's dictionary (returning its size or zero on failure)
+    // N.B. the dictionary is locked until the message is sent so that definitions always precede their use
+    
+    template <class ...Args>
+    size_t SendEncodedFromClient(const Args& ...args)
+    {
+        SharedLock lock(&mMutex);
+        RecursiveLock encoderLock(&mEncoderMutex);
+        
+        if (!mConnection && !mLocalConnection)
+            return 0;
+        
+        NetworkByteChunk chunk(mEncoder, args...);
+        
+        return SendDataFromClient(chunk) ? chunk.Size() : 0;
     }
     
     bool IsClientConnected() const
     {
         SharedLock lock(&mMutex);
         
-        return mConnection;
+        return mConnection || mLocalConnection;
     }
     
     WDL_String GetServerName() const
@@ -94,6 +156,40 @@ public:
         return mPort;
     }
     
+    // Inbound events are written to the capture whilst one is set (the capture must outlive the client or be unset)
+    
+    void SetClientCapture(NetworkCapture* capture)
+    {
+        mCapture = capture;
+    }
+    
+    // Pass a captured event directly to the handlers (regardless of whether the client is connected)
+    
+    void ReplayClientEvent(NetworkCapture::Kind kind, const void* pData, size_t size)
+    {
+        SharedLock lock(&mMutex);
+        
+        if (kind == NetworkCapture::Kind::ClientData)
+        {
+            iplug::IByteStream stream(pData, static_cast<int>(size));
+            OnDataToClient(stream);
+        }
+        else if (kind == NetworkCapture::Kind::ClientClose)
+        {
+            mDecoder.Reset();
+            OnCloseClient();
+        }
+    }
+    
+protected:
+    
+    // The dictionary decoder for the current connection (only for use whilst handling its data)
+    
+    NetworkDictionary::Decoder* ClientDecoder()
+    {
+        return &mDecoder;
+    }
+    
 private:
     
     // Customisable Methods
@@ -101,6 +197,10 @@ private:
     virtual void OnDataToClient(const iplug::IByteStream& data) = 0;
     virtual void OnCloseClient() {}
     
+    // Deferred transport events are passed here (to be run later on a thread of the owner's choosing)
+    
+    virtual void Dispatch(std::function<void()>&& event) { event(); }
+    
     static NetworkClientInterface* AsClient(void *x)
     {
         return reinterpret_cast<NetworkClientInterface *>(x);
@@ -114,14 +214,19 @@ private:
         
         // Avoid closing twice (in case the API calls close multiple times)
         
-        if (mConnection)
+        if (mConnection || mLocalConnection)
         {
             lock.Promote();
             std::unique_ptr<T> release(mConnection);
+            std::unique_ptr<LocalClient> releaseLocal(mLocalConnection);
             mConnection = nullptr;
+            mLocalConnection = nullptr;
             mServer.Set("");
             mPort = 0;
+            mEncoder.Reset();
+            mDecoder.Reset();
             lock.Demote();
+            Capture(NetworkCapture::Kind::ClientClose);
             OnCloseClient();
             DBGMSG("CLIENT: Disconnected\n");
         }
@@ -133,34 +238,66 @@ private:
         
         iplug::IByteStream stream(pData, static_cast<int>(size));
         
+        Capture(NetworkCapture::Kind::ClientData, pData, size);
         OnDataToClient(stream);
     }
     
+    void Capture(NetworkCapture::Kind kind, const void* pData = nullptr, size_t size = 0)
+    {
+        if (NetworkCapture* capture = mCapture)
+            capture->Client(kind, pData, size);
+    }
+    
     // Static Handlers
     
     static void DoDataClient(ConnectionID id, const void *pData, size_t size, void *x)
     {
-        AsClient(x)->HandleData(pData, size);
+        auto pClient = AsClient(x);
+        
+        // Deferred data must be copied as the transport owns the buffer only for this call
+        
+        if (Types::sDeferEvents)
+        {
+            auto pBytes = static_cast<const uint8_t *>(pData);
+            std::vector<uint8_t> data(pBytes, pBytes + size);
+            
+            pClient->Dispatch([pClient, data]() { pClient->HandleData(data.data(), data.size()); });
+        }
+        else
+            pClient->HandleData(pData, size);
     }
     
     static void DoCloseClient(ConnectionID id, void *x)
     {
-        AsClient(x)->HandleClose();
+        auto pClient = AsClient(x);
+        
+        if (Types::sDeferEvents)
+            pClient->Dispatch([pClient]() { pClient->HandleClose(); });
+        else
+            pClient->HandleClose();
     }
     
     WDL_String mServer;
     uint16_t mPort;
     mutable SharedMutex mMutex;
     T *mConnection;
+    LocalClient *mLocalConnection;
+    std::atomic<bool> mUseLocal;
+    std::atomic<NetworkCapture *> mCapture;
+    RecursiveMutex mEncoderMutex;
+    NetworkDictionary::Encoder mEncoder;
+    NetworkDictionary::Decoder mDecoder;
 };
 
 // Concrete implementation based on the platform
 
 #ifdef __APPLE__
-using NetworkClient = NetworkClientInterface<nw_ws_client>;
+using NetworkClientTransport = nw_ws_client;
 #else
-using NetworkClient = NetworkClientInterface<cw_ws_client>;
+using NetworkClientTransport = cw_ws_client;
 #endif
 
+using NetworkClient = NetworkClientInterface<NetworkClientTransport>;
+
 #endif /* NETWORKUTILITIES_HPP */
 
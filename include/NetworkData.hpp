@@ -2,12 +2,233 @@
 #ifndef NETWORKDATA_HPP
 #define NETWORKDATA_HPP
 
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include <wdlstring.h>
 
 #include "IPlugStructs.h"
 
+// A string stored inline with a fixed capacity (so that copies never allocate)
+// Longer strings are truncated (this is intended for bounded strings such as host names)
+
+template <int N>
+class NetworkFixedString
+{
+public:
+    
+    NetworkFixedString(const char* str = "")
+    {
+        Set(str);
+    }
+    
+    NetworkFixedString(const WDL_String& str)
+    {
+        Set(str.Get());
+    }
+    
+    NetworkFixedString(const NetworkFixedString& str)
+    {
+        Set(str.mStr, str.mLength);
+    }
+    
+    NetworkFixedString& operator=(const NetworkFixedString& str)
+    {
+        Set(str.mStr, str.mLength);
+        return *this;
+    }
+    
+    void Set(const char* str)
+    {
+        Set(str, str ? static_cast<int>(strnlen(str, N - 1)) : 0);
+    }
+    
+    void Set(const char* str, int length)
+    {
+        mLength = std::min(std::max(length, 0), N - 1);
+        memmove(mStr, str, mLength);
+        mStr[mLength] = 0;
+    }
+    
+    const char* Get() const { return mStr; }
+    int GetLength() const { return mLength; }
+    
+    static constexpr int Capacity() { return N - 1; }
+    
+private:
+    
+    int mLength;
+    char mStr[N];
+};
+
+// Host names are at most 253 characters
+
+using NetworkName = NetworkFixedString<256>;
+
+// A dictionary for strings that repeat on a connection (so that each is only sent in full once)
+// Strings are written as their length and bytes or as a negative header for a dictionary entry
+// A header of -1 - 2 * index refers to an entry and -2 - 2 * index defines it (followed by the string as usual)
+// The encoder writes new definitions as a block at the start of the chunk (so they are read even if the rest is not)
+// The shared entries are known to both ends in advance (and so are referred to without any connection state)
+// N.B. chunks must be sent in the order that they are encoded for definitions to precede their use
+
+class NetworkDictionary
+{
+public:
+    
+    static constexpr int sMaxEntries = 1024;
+    static constexpr size_t sMaxLength = 64;
+    
+    class Encoder
+    {
+    public:
+        
+        void Reset()
+        {
+            mEntries.clear();
+            mDefinitions.clear();
+        }
+        
+        // New entries are referred to straight away and defined by the next call to PutDefinitions()
+        
+        void Put(iplug::IByteChunk& chunk, const char* str)
+        {
+            int index = FindShared(str);
+            
+            if (index < 0 && strlen(str) <= sMaxLength)
+            {
+                auto it = mEntries.find(str);
+                
+                if (it != mEntries.end())
+                    index = it->second;
+                else if (mEntries.size() < sMaxEntries)
+                {
+                    index = NumShared() + static_cast<int>(mEntries.size());
+                    mEntries.emplace(str, index);
+                    mDefinitions.emplace_back(str);
+                }
+            }
+            
+            PutReference(chunk, str, index);
+        }
+        
+        void PutDefinitions(iplug::IByteChunk& chunk)
+        {
+            int index = NumShared() + static_cast<int>(mEntries.size() - mDefinitions.size());
+            
+            for (auto it = mDefinitions.begin(); it != mDefinitions.end(); it++, index++)
+            {
+                int header = Definition(index);
+                chunk.Put(&header);
+                chunk.PutStr(it->c_str());
+            }
+            
+            mDefinitions.clear();
+        }
+        
+        // Without an encoder only the shared entries are used
+        
+        static void PutShared(iplug::IByteChunk& chunk, const char* str)
+        {
+            PutReference(chunk, str, FindShared(str));
+        }
+        
+    private:
+        
+        static void PutReference(iplug::IByteChunk& chunk, const char* str, int index)
+        {
+            if (index >= 0)
+            {
+                int header = Reference(index);
+                chunk.Put(&header);
+            }
+            else
+                chunk.PutStr(str);
+        }
+        
+        std::unordered_map<std::string, int> mEntries;
+        std::vector<std::string> mDefinitions;
+    };
+    
+    class Decoder
+    {
+    public:
+        
+        void Reset()
+        {
+            mEntries.clear();
+        }
+        
+        // Entries are defined in order (or redefined if a message is read more than once)
+        
+        bool Define(int index, const char* str)
+        {
+            size_t entry = static_cast<size_t>(index - NumShared());
+            
+            if (index < NumShared() || entry > mEntries.size() || entry >= sMaxEntries)
+                return false;
+            
+            if (entry == mEntries.size())
+                mEntries.emplace_back(str);
+            else
+                mEntries[entry] = str;
+            
+            return true;
+        }
+        
+        const char* Find(int index) const
+        {
+            size_t entry = static_cast<size_t>(index - NumShared());
+            
+            return index >= NumShared() && entry < mEntries.size() ? mEntries[entry].c_str() : nullptr;
+        }
+        
+    private:
+        
+        std::vector<std::string> mEntries;
+    };
+    
+    // The protocol tags and connection message names (changing these changes the protocol)
+    
+    static int NumShared()
+    {
+        return static_cast<int>(sizeof(sShared) / sizeof(sShared[0]));
+    }
+    
+    static const char* Shared(int index)
+    {
+        return index >= 0 && index < NumShared() ? sShared[index] : nullptr;
+    }
+    
+    static int FindShared(const char* str)
+    {
+        for (int i = 0; i < NumShared(); i++)
+        {
+            if (!strcmp(str, sShared[i]))
+                return i;
+        }
+        
+        return -1;
+    }
+    
+    static int Reference(int index) { return -1 - 2 * index; }
+    static int Definition(int index) { return -2 - 2 * index; }
+    
+    static bool IsEntry(int header) { return header < 0; }
+    static bool IsDefinition(int header) { return (-1 - header) & 1; }
+    static int Index(int header) { return (-1 - header) >> 1; }
+    
+private:
+    
+    static constexpr const char *sShared[] = { "~", "-", "Negotiate", "Confirm", "Ping", "Hosts", "Peers", "Switch", "Redirect", "Resume", "Resumed", "Token", "Links" };
+};
+
 // A wrapper for iplug::IByteChunk that can be constructued with its contents
 // Multiple items can also be added at a time later
+// Strings are encoded with the given dictionary encoder (or only the shared entries if there is none)
 
 struct NetworkByteChunk : public iplug::IByteChunk
 {
@@ -19,14 +240,38 @@ public:
         Add(std::forward<const Args>(args)...);
     }
     
+    // The contents are encoded first (so that the definitions they need can be written ahead of them)
+    
+    template <typename ...Args>
+    NetworkByteChunk(NetworkDictionary::Encoder& encoder, const Args& ...args)
+    {
+        NetworkByteChunk contents;
+        
+        contents.mEncoder = &encoder;
+        contents.Add(std::forward<const Args>(args)...);
+        encoder.PutDefinitions(*this);
+        PutBytes(contents.GetData(), contents.Size());
+    }
+    
+    inline void Add() {}
+    
     inline void Add(const WDL_String& str)
     {
-        PutStr(str.Get());
+        Add(str.Get());
+    }
+    
+    template <int N>
+    inline void Add(const NetworkFixedString<N>& str)
+    {
+        Add(str.Get());
     }
     
     inline void Add(const char* str)
     {
-        PutStr(str);
+        if (mEncoder)
+            mEncoder->Put(*this, str);
+        else
+            NetworkDictionary::Encoder::PutShared(*this, str);
     }
     
     inline void Add(const iplug::IByteChunk& chunk)
@@ -52,17 +297,22 @@ public:
         Add(std::forward<const Args>(args)...);
     }
     
+private:
+    
+    NetworkDictionary::Encoder *mEncoder = nullptr;
 };
 
 // A wrapper for iplug::IByteStream that tracks its own position
+// Dictionary entries are decoded with the given decoder (or only the shared entries if there is none)
 
 class NetworkByteStream
 {
 public:
     
-    NetworkByteStream(const iplug::IByteStream& stream, int startPos = 0)
+    NetworkByteStream(const iplug::IByteStream& stream, int startPos = 0, NetworkDictionary::Decoder* decoder = nullptr)
     : mStream(stream)
     , mPos(startPos)
+    , mDecoder(decoder)
     {}
     
     inline int Tell() const
@@ -83,7 +333,60 @@ public:
     
     inline void Get(WDL_String& str)
     {
-        mPos = mStream.GetStr(str, mPos);
+        mPos = GetString(str, mPos);
+    }
+    
+    // Fixed strings are read without allocating (unless the string defines a dictionary entry)
+    
+    template <int N>
+    inline void Get(NetworkFixedString<N>& str)
+    {
+        int header = 0;
+        int pos = mStream.Get(&header, mPos);
+        
+        if (pos >= 0 && NetworkDictionary::IsEntry(header) && !NetworkDictionary::IsDefinition(header))
+        {
+            const char* entry = Find(NetworkDictionary::Index(header));
+            
+            str.Set(entry ? entry : "");
+            mPos = entry ? pos : -1;
+            return;
+        }
+        
+        int length = header;
+        
+        if (pos >= 0 && NetworkDictionary::IsEntry(header))
+            pos = mStream.Get(&length, pos);
+        
+        if (pos < 0 || length < 0 || pos + length > mStream.Size())
+        {
+            str.Set("");
+            mPos = -1;
+            return;
+        }
+        
+        if (NetworkDictionary::IsEntry(header))
+        {
+            // Definitions are stored in full (only the copy returned is truncated)
+            
+            std::string entry(length, 0);
+            
+            mStream.GetBytes(&entry[0], length, pos);
+            str.Set(entry.c_str(), length);
+            
+            if (mDecoder)
+                mDecoder->Define(NetworkDictionary::Index(header), entry.c_str());
+        }
+        else
+        {
+            char buffer[N];
+            int size = std::min(length, N - 1);
+            
+            mStream.GetBytes(buffer, size, pos);
+            str.Set(buffer, size);
+        }
+        
+        mPos = pos + length;
     }
     
     template <class First, class ...Args>
@@ -93,16 +396,79 @@ public:
         Get(args...);
     }
     
+    // Read the block of definitions at the start of a chunk into the decoder (before the message is handled)
+    
+    bool ReadDefinitions()
+    {
+        WDL_String str;
+        int header = 0;
+        
+        while (mPos >= 0 && mStream.Get(&header, mPos) >= 0 && NetworkDictionary::IsEntry(header) && NetworkDictionary::IsDefinition(header))
+            mPos = GetString(str, mPos);
+        
+        return mPos >= 0;
+    }
+    
+    // Copy the next string into a buffer (truncating if necessary) without advancing
+    
+    bool PeekStr(char* str, int size) const
+    {
+        int length = 0;
+        int pos = mStream.Get(&length, mPos);
+        
+        if (pos >= 0 && NetworkDictionary::IsEntry(length))
+        {
+            if (NetworkDictionary::IsDefinition(length))
+                pos = mStream.Get(&length, pos);
+            else if (const char* entry = Find(NetworkDictionary::Index(length)))
+            {
+                strncpy(str, entry, size - 1);
+                str[size - 1] = 0;
+                return true;
+            }
+            else
+                pos = -1;
+        }
+        
+        if (pos < 0 || length < 0 || pos + length > mStream.Size())
+        {
+            str[0] = 0;
+            return false;
+        }
+        
+        length = std::min(length, size - 1);
+        mStream.GetBytes(str, length, pos);
+        str[length] = 0;
+        
+        return true;
+    }
+    
     // Look to see if the next item is a tag matching the input
     // Advance if the tag is matched
     
     bool IsNextTag(const char* tag)
     {
+        int header = 0;
+        int pos = mStream.Get(&header, mPos);
+        
+        // References are compared without copying the string
+        
+        if (pos >= 0 && NetworkDictionary::IsEntry(header) && !NetworkDictionary::IsDefinition(header))
+        {
+            const char* entry = Find(NetworkDictionary::Index(header));
+            
+            if (!entry || strcmp(entry, tag))
+                return false;
+            
+            mPos = pos;
+            return true;
+        }
+        
         WDL_String nextTag;
         
-        int pos = mStream.GetStr(nextTag, mPos);
+        pos = GetString(nextTag, mPos);
                 
-        if (strcmp(nextTag.Get(), tag) == 0)
+        if (pos >= 0 && strcmp(nextTag.Get(), tag) == 0)
         {
             mPos = pos;
             return true;
@@ -113,8 +479,44 @@ public:
     
 private:
     
+    // Unknown references fail the stream (as for reads past the end)
+    
+    int GetString(WDL_String& str, int pos)
+    {
+        int header = 0;
+        int next = mStream.Get(&header, pos);
+        
+        if (next < 0 || !NetworkDictionary::IsEntry(header))
+            return mStream.GetStr(str, pos);
+        
+        if (NetworkDictionary::IsDefinition(header))
+        {
+            next = mStream.GetStr(str, next);
+            
+            if (next >= 0 && mDecoder)
+                mDecoder->Define(NetworkDictionary::Index(header), str.Get());
+            
+            return next;
+        }
+        
+        const char* entry = Find(NetworkDictionary::Index(header));
+        
+        str.Set(entry ? entry : "");
+        
+        return entry ? next : -1;
+    }
+    
+    const char* Find(int index) const
+    {
+        if (index < NetworkDictionary::NumShared())
+            return NetworkDictionary::Shared(index);
+        
+        return mDecoder ? mDecoder->Find(index) : nullptr;
+    }
+    
     const iplug::IByteStream& mStream;
     int mPos;
+    NetworkDictionary::Decoder *mDecoder;
 };
 
 #endif /* NETWORKDATA_HPP */
@@ -0,0 +1,596 @@
+
+#ifndef NETWORKHUB_HPP
+#define NETWORKHUB_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "IPlugLogger.h"
+
+#include "BeaconPeer.hpp"
+#include "DiscoverablePeer.hpp"
+#include "NetworkTiming.hpp"
+
+// Discovery backends that a peer may use
+
+enum class DiscoveryMode { Bonjour, Beacon, Both };
+
+// A process-wide discovery hub shared by all peers with the same registration name and discovery mode
+// One Bonjour registration and one beacon serve every attached endpoint (rather than one of each per endpoint)
+// The server of an endpoint that is discovering is advertised and discovered services are passed to all endpoints
+// Endpoints may also be driven by a single shared thread rather than a discovery thread each
+// N.B. only discovery is shared - each endpoint keeps its own server and client (endpoints in one process find each
+// other through the local registry and gather on one server, so in practice one server serves the process)
+// Multiplexing the servers and clients of several endpoints over shared connections is deliberately not done
+
+class NetworkHub : public std::enable_shared_from_this<NetworkHub>
+{
+    static constexpr double sFindIntervalMS = 100.0;
+    static constexpr double sMaxWaitMS = 100.0;
+    static constexpr double sRegisterGraceMS = 1000.0;
+    
+public:
+    
+    // Updated services keep their address but have new metadata
+    
+    template <class Service>
+    struct ServiceHandlers
+    {
+        std::function<void(const Service&)> mAdded;
+        std::function<void(const Service&)> mRemoved;
+        std::function<void(const Service&)> mUpdated;
+    };
+    
+    struct Handlers
+    {
+        ServiceHandlers<bonjour_service> mBonjour;
+        ServiceHandlers<BeaconService> mBeacon;
+    };
+    
+    struct Stats
+    {
+        uint64_t mStarts = 0;
+        uint64_t mResolves = 0;
+        uint64_t mResolvesCached = 0;
+        uint64_t mChurn = 0;
+    };
+    
+private:
+    
+    struct Endpoint
+    {
+        Endpoint(const void* owner, uint16_t port, uint64_t id, const Handlers& handlers)
+        : mOwner(owner)
+        , mPort(port)
+        , mID(id)
+        , mHandlers(handlers)
+        {}
+        
+        const void *mOwner;
+        uint16_t mPort;
+        uint64_t mID;
+        Handlers mHandlers;
+        bool mDiscovering = false;
+        uint32_t mLoad = 0;
+        
+        std::function<void()> mDiscover;
+        IntervalPoll mPoll = IntervalPoll(0.0);
+        uint64_t mDrive = 0;
+    };
+    
+    using Lock = std::unique_lock<std::recursive_mutex>;
+    
+public:
+    
+    // Shared driving lasts as long as the handle returned when it starts (releasing it waits for a call in progress)
+    // N.B. a handle declared after its endpoint is released before any part of the endpoint is destroyed
+    
+    class Driver
+    {
+    public:
+        
+        Driver() = default;
+        
+        Driver(std::shared_ptr<NetworkHub> hub, const void* owner, uint64_t drive)
+        : mHub(std::move(hub))
+        , mOwner(owner)
+        , mDrive(drive)
+        {}
+        
+        Driver(Driver&& other) noexcept
+        : mHub(std::move(other.mHub))
+        , mOwner(other.mOwner)
+        , mDrive(other.mDrive)
+        {}
+        
+        Driver& operator=(Driver&& other) noexcept
+        {
+            if (this != &other)
+            {
+                Release();
+                mHub = std::move(other.mHub);
+                mOwner = other.mOwner;
+                mDrive = other.mDrive;
+            }
+            
+            return *this;
+        }
+        
+        ~Driver()
+        {
+            Release();
+        }
+        
+        Driver(const Driver&) = delete;
+        Driver& operator=(const Driver&) = delete;
+        
+        void Release()
+        {
+            if (mHub)
+                mHub->Undrive(mOwner, mDrive);
+            
+            mHub.reset();
+        }
+        
+    private:
+        
+        std::shared_ptr<NetworkHub> mHub;
+        const void *mOwner = nullptr;
+        uint64_t mDrive = 0;
+    };
+    
+    // Get the hub for a given registration name and mode (creating it if necessary)
+    
+    static std::shared_ptr<NetworkHub> Get(const char* regname, DiscoveryMode mode)
+    {
+        static std::mutex mutex;
+        static std::unordered_map<std::string, std::weak_ptr<NetworkHub>> hubs;
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        
+        for (auto it = hubs.begin(); it != hubs.end(); )
+        {
+            if (it->second.expired())
+                it = hubs.erase(it);
+            else
+                it++;
+        }
+        
+        std::string key = std::string(regname) + "/" + std::to_string(static_cast<int>(mode));
+        std::shared_ptr<NetworkHub> hub = hubs[key].lock();
+        
+        if (!hub)
+        {
+            hub = std::shared_ptr<NetworkHub>(new NetworkHub(regname, mode));
+            hubs[key] = hub;
+        }
+        
+        return hub;
+    }
+    
+    ~NetworkHub()
+    {
+        Lock lock(mMutex);
+        
+        mDriving = false;
+        mCondition.notify_all();
+        lock.unlock();
+        
+        if (mThread.joinable())
+            mThread.join();
+        
+        lock.lock();
+        Retire(*mDiscoverable);
+        mBeacon->Stop();
+    }
+    
+    NetworkHub(const NetworkHub&) = delete;
+    NetworkHub& operator=(const NetworkHub&) = delete;
+    
+    // Configuration
+    
+    void SetProtocol(uint32_t version, uint32_t capabilities)
+    {
+        Lock lock(mMutex);
+        
+        mProtocolVersion = version;
+        mCapabilities = capabilities;
+        
+        if (mBeacon)
+            mBeacon->SetProtocol(version, capabilities);
+    }
+    
+    void SetBeaconInterface(const char* address)
+    {
+        Lock lock(mMutex);
+        
+        mBeaconInterface = address;
+        
+        if (mBeacon)
+            mBeacon->SetInterface(address);
+    }
+    
+    // Endpoints (services that have already been found are passed to a new endpoint immediately)
+    
+    void Attach(const void* owner, uint16_t port, uint64_t id, const Handlers& handlers)
+    {
+        Lock lock(mMutex);
+        
+        mEndpoints.emplace_back(owner, port, id, handlers);
+        Advertise();
+        
+        auto bonjourPeers = mDiscoverable->Peers();
+        auto beaconPeers = mBeacon->Peers();
+        
+        for (auto it = bonjourPeers->begin(); it != bonjourPeers->end(); it++)
+            mEndpoints.back().mHandlers.mBonjour.mAdded(*it);
+        
+        for (auto it = beaconPeers->begin(); it != beaconPeers->end(); it++)
+            mEndpoints.back().mHandlers.mBeacon.mAdded(*it);
+    }
+    
+    // N.B. this waits for the shared thread if it is currently driving the endpoint
+    
+    void Detach(const void* owner)
+    {
+        Lock lock(mMutex);
+        
+        mCondition.wait(lock, [&]() { return mDriven != owner; });
+        mEndpoints.remove_if([&](const Endpoint& a) { return a.mOwner == owner; });
+        Advertise();
+    }
+    
+    // Discovery runs while any endpoint wants it
+    
+    void StartDiscovery(const void* owner)
+    {
+        Lock lock(mMutex);
+        
+        auto it = Find(owner);
+        
+        if (it != mEndpoints.end())
+        {
+            it->mDiscovering = true;
+            Advertise();
+        }
+    }
+    
+    void StopDiscovery(const void* owner)
+    {
+        Lock lock(mMutex);
+        
+        auto it = Find(owner);
+        
+        if (it != mEndpoints.end())
+        {
+            it->mDiscovering = false;
+            Advertise();
+        }
+    }
+    
+    bool IsDiscoveryRunning(const void* owner) const
+    {
+        Lock lock(mMutex);
+        
+        auto it = std::find_if(mEndpoints.begin(), mEndpoints.end(), [&](const Endpoint& a) { return a.mOwner == owner; });
+        
+        if (it == mEndpoints.end() || !it->mDiscovering)
+            return false;
+        
+        return (!UsesBonjour() || mDiscoverable->IsRunning()) && (!UsesBeacon() || mBeacon->IsRunning());
+    }
+    
+    // Update the load of an endpoint and the discovered services (at most once per find interval)
+    
+    void FindPeers(const void* owner, uint32_t load)
+    {
+        Lock lock(mMutex);
+        
+        auto it = Find(owner);
+        
+        if (it != mEndpoints.end())
+            it->mLoad = load;
+        
+        if (!mFindPoll())
+            return;
+        
+        // N.B. a new registration is given time to browse (so that services are not briefly reported as removed)
+        
+        if (UsesBonjour() && (!mAdopted || mRegistered.Interval() * 1000.0 >= sRegisterGraceMS))
+            mDiscoverable->FindPeers();
+        
+        if (UsesBeacon())
+        {
+            mBeacon->SetLoad(mAdvertised ? mAdvertised->mLoad : 0);
+            mBeacon->FindPeers();
+        }
+    }
+    
+    bool Resolve(const char* name)
+    {
+        Lock lock(mMutex);
+        
+        return mDiscoverable->Resolve(name);
+    }
+    
+    WDL_String GetHostName() const
+    {
+        Lock lock(mMutex);
+        
+        return mDiscoverable->GetHostName();
+    }
+    
+    Stats GetStats() const
+    {
+        Lock lock(mMutex);
+        
+        Stats stats = mRetired;
+        
+        stats.mStarts += mDiscoverable->Starts();
+        stats.mResolves += mDiscoverable->ResolveMisses();
+        stats.mResolvesCached += mDiscoverable->ResolveHits();
+        stats.mChurn += mDiscoverable->Churn() + mBeacon->Churn();
+        
+        return stats;
+    }
+    
+    // Shared driving (the discover function is called on the hub thread at the given interval until the handle is released)
+    // N.B. driving again replaces the discover function (and releasing an earlier handle then has no effect)
+    
+    [[nodiscard]] Driver Drive(const void* owner, std::function<void()> discover, double intervalMS)
+    {
+        Lock lock(mMutex);
+        
+        auto it = Find(owner);
+        
+        if (it == mEndpoints.end())
+            return Driver();
+        
+        it->mDiscover = std::move(discover);
+        it->mPoll = IntervalPoll(intervalMS);
+        it->mDrive = ++mDrives;
+        
+        if (!mThread.joinable())
+        {
+            mDriving = true;
+            mThread = std::thread([this]() { Run(); });
+        }
+        
+        mCondition.notify_all();
+        
+        return Driver(shared_from_this(), owner, it->mDrive);
+    }
+    
+private:
+    
+    NetworkHub(const char* regname, DiscoveryMode mode)
+    : mRegName(regname)
+    , mMode(mode)
+    , mHostName(DiscoverablePeer::GetStaticHostName())
+    , mProtocolVersion(0)
+    , mCapabilities(0)
+    , mBeaconInterface("0.0.0.0")
+    , mAdvertised(nullptr)
+    , mFindPoll(sFindIntervalMS)
+    , mDriven(nullptr)
+    , mDriving(false)
+    {
+        Rebuild(nullptr);
+    }
+    
+    bool UsesBonjour() const { return mMode != DiscoveryMode::Beacon; }
+    bool UsesBeacon() const { return mMode != DiscoveryMode::Bonjour; }
+    
+    void Undrive(const void* owner, uint64_t drive)
+    {
+        Lock lock(mMutex);
+        
+        mCondition.wait(lock, [&]() { return mDriven != owner; });
+        
+        auto it = Find(owner);
+        
+        if (it != mEndpoints.end() && it->mDrive == drive)
+            it->mDiscover = nullptr;
+    }
+    
+    std::list<Endpoint>::iterator Find(const void* owner)
+    {
+        return std::find_if(mEndpoints.begin(), mEndpoints.end(), [&](const Endpoint& a) { return a.mOwner == owner; });
+    }
+    
+    // Advertise the first discovering endpoint (or the first endpoint if none are discovering)
+    // N.B. the backends are rebuilt if the advertised server changes (and must be called with the mutex held)
+    
+    void Advertise()
+    {
+        auto it = std::find_if(mEndpoints.begin(), mEndpoints.end(), [](const Endpoint& a) { return a.mDiscovering; });
+        
+        if (it == mEndpoints.end())
+            it = mEndpoints.begin();
+        
+        Endpoint *advertise = it == mEndpoints.end() ? nullptr : &*it;
+        
+        if (advertise != mAdvertised)
+            Rebuild(advertise);
+        
+        bool discovering = advertise && advertise->mDiscovering;
+        
+        if (discovering)
+        {
+            if (UsesBonjour() && !mDiscoverable->IsRunning())
+                mDiscoverable->Start();
+            
+            if (UsesBeacon() && !mBeacon->IsRunning())
+                mBeacon->Start();
+        }
+        else
+        {
+            if (mDiscoverable->IsRunning())
+                mDiscoverable->Stop();
+            
+            mBeacon->Stop();
+        }
+    }
+    
+    // The beacon announces a new endpoint in place but Bonjour must register again if the port changes
+    // N.B. services found so far are carried over to a new registration (so endpoints are not told they were removed)
+    
+    void Rebuild(Endpoint* advertise)
+    {
+        uint16_t port = advertise ? advertise->mPort : 0;
+        uint64_t id = advertise ? advertise->mID : 0;
+        
+        mAdvertised = advertise;
+        
+        if (!mBeacon)
+        {
+            mBeacon.reset(new BeaconPeer(mHostName.Get(), mRegName.c_str(), port, id));
+            mBeacon->SetProtocol(mProtocolVersion, mCapabilities);
+            mBeacon->SetInterface(mBeaconInterface.c_str());
+            SetHandlers<BeaconService>(*mBeacon, &Handlers::mBeacon);
+        }
+        else
+            mBeacon->SetService(port, id);
+        
+        if (mDiscoverable && mDiscoverable->Port() == port)
+            return;
+        
+        std::unique_ptr<DiscoverablePeer> previous = std::move(mDiscoverable);
+        
+        mDiscoverable.reset(new DiscoverablePeer(mHostName.Get(), mRegName.c_str(), port));
+        mRegistered.Start();
+        mAdopted = previous != nullptr;
+        
+        if (previous)
+        {
+            mDiscoverable->Adopt(*previous);
+            previous->SetHandlers(nullptr, nullptr, nullptr, nullptr);
+            Retire(*previous);
+        }
+        
+        SetHandlers<bonjour_service>(*mDiscoverable, &Handlers::mBonjour);
+    }
+    
+    // Stop a Bonjour peer and keep its statistics
+    
+    void Retire(DiscoverablePeer& discoverable)
+    {
+        if (discoverable.IsRunning())
+            discoverable.Stop();
+        
+        mRetired.mStarts += discoverable.Starts();
+        mRetired.mResolves += discoverable.ResolveMisses();
+        mRetired.mResolvesCached += discoverable.ResolveHits();
+        mRetired.mChurn += discoverable.Churn();
+    }
+    
+    // Services are passed to every endpoint (changes are passed as a removal followed by an addition)
+    
+    template <class Service, class Discovery>
+    void SetHandlers(Discovery& discovery, ServiceHandlers<Service> Handlers::*member)
+    {
+        auto added = [this, member](const Service& service)
+        {
+            Lock lock(mMutex);
+            
+            for (auto it = mEndpoints.begin(); it != mEndpoints.end(); it++)
+                ((it->mHandlers).*member).mAdded(service);
+        };
+        
+        auto removed = [this, member](const Service& service)
+        {
+            Lock lock(mMutex);
+            
+            for (auto it = mEndpoints.begin(); it != mEndpoints.end(); it++)
+                ((it->mHandlers).*member).mRemoved(service);
+        };
+        
+        auto updated = [this, member](const Service& service)
+        {
+            Lock lock(mMutex);
+            
+            for (auto it = mEndpoints.begin(); it != mEndpoints.end(); it++)
+            {
+                if (((it->mHandlers).*member).mUpdated)
+                    ((it->mHandlers).*member).mUpdated(service);
+            }
+        };
+        
+        auto changed = [added, removed](const Service& previous, const Service& current)
+        {
+            removed(previous);
+            added(current);
+        };
+        
+        discovery.SetHandlers(added, removed, changed, updated);
+    }
+    
+    // The shared thread calls each driven endpoint when it is due (without holding the mutex)
+    
+    void Run()
+    {
+        Lock lock(mMutex);
+        
+        while (mDriving)
+        {
+            double wait = sMaxWaitMS;
+            
+            for (auto it = mEndpoints.begin(); it != mEndpoints.end(); it++)
+            {
+                if (!it->mDiscover)
+                    continue;
+                
+                if (it->mPoll())
+                {
+                    auto discover = it->mDiscover;
+                    
+                    mDriven = it->mOwner;
+                    lock.unlock();
+                    discover();
+                    lock.lock();
+                    mDriven = nullptr;
+                    mCondition.notify_all();
+                }
+                
+                wait = std::min(wait, it->mPoll.Until());
+            }
+            
+            mCondition.wait_for(lock, std::chrono::duration<double, std::milli>(wait));
+        }
+    }
+    
+    const std::string mRegName;
+    const DiscoveryMode mMode;
+    const WDL_String mHostName;
+    
+    uint32_t mProtocolVersion;
+    uint32_t mCapabilities;
+    std::string mBeaconInterface;
+    
+    mutable std::recursive_mutex mMutex;
+    std::condition_variable_any mCondition;
+    
+    std::list<Endpoint> mEndpoints;
+    Endpoint *mAdvertised;
+    std::unique_ptr<DiscoverablePeer> mDiscoverable;
+    std::unique_ptr<BeaconPeer> mBeacon;
+    IntervalPoll mFindPoll;
+    CPUTimer mRegistered;
+    bool mAdopted = false;
+    Stats mRetired;
+    
+    const void *mDriven;
+    uint64_t mDrives = 0;
+    bool mDriving;
+    std::thread mThread;
+};
+
+#endif /* NETWORKHUB_HPP */
@@ -0,0 +1,406 @@
+
+#ifndef NETWORKMETRICS_HPP
+#define NETWORKMETRICS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+// Message and byte counters for the traffic of a peer (by message tag and by connection)
+// Counting never locks (counters are relaxed atomics in fixed tables whose slots are claimed when a tag is added or a
+// connection is opened)
+// Only added tags are counted by name (so that peers cannot fill the table) and any others are counted together
+// Traffic on connections that are not open (e.g. a send racing a close) is only counted by tag
+// Labels for connections, releasing connections and reading a snapshot take a mutex (none happen per message)
+
+class NetworkMetrics
+{
+    static constexpr int sNumTags = 64;
+    static constexpr int sNumConnections = 256;
+    static constexpr int sMaxName = 32;
+    static constexpr uint64_t sReleased = ~0ULL;
+    
+public:
+    
+    struct Values
+    {
+        uint64_t mSentMessages = 0;
+        uint64_t mSentBytes = 0;
+        uint64_t mReceivedMessages = 0;
+        uint64_t mReceivedBytes = 0;
+    };
+    
+    struct Snapshot
+    {
+        std::vector<std::pair<std::string, Values>> mTags;
+        std::vector<std::pair<std::string, Values>> mConnections;
+    };
+    
+    // Connections other than those to individual clients
+    
+    static constexpr uint64_t sServerConnection = ~0ULL - 1;
+    static constexpr uint64_t sBroadcastConnection = ~0ULL - 2;
+    
+    NetworkMetrics(const std::vector<const char*>& tags)
+    {
+        for (auto it = tags.begin(); it != tags.end(); it++)
+            AddTag(*it);
+        
+        Open(sServerConnection);
+        Open(sBroadcastConnection);
+    }
+    
+    NetworkMetrics(const NetworkMetrics&) = delete;
+    NetworkMetrics& operator=(const NetworkMetrics&) = delete;
+    
+    // Tags may also be added whilst counting (once the table is full further tags are counted as other)
+    
+    void AddTag(const char* tag)
+    {
+        Claim(mTags, Hash(tag), [&](char* name) { strncpy(name, tag, sMaxName - 1); });
+    }
+    
+    // Connections are counted from when they are opened until they are released
+    
+    void Open(uint64_t connection)
+    {
+        auto name = [&](char* name)
+        {
+            if (connection == sServerConnection)
+                strncpy(name, "server", sMaxName - 1);
+            else if (connection == sBroadcastConnection)
+                strncpy(name, "broadcast", sMaxName - 1);
+            else
+                snprintf(name, sMaxName, "%016llx", static_cast<unsigned long long>(connection));
+        };
+        
+        Claim(mConnections, connection, name);
+    }
+    
+    void Sent(uint64_t connection, const char* tag, size_t bytes)
+    {
+        FindTag(tag).Sent(bytes);
+        
+        if (Counters* counters = Find(mConnections, connection))
+            counters->Sent(bytes);
+    }
+    
+    void Received(uint64_t connection, const char* tag, size_t bytes)
+    {
+        FindTag(tag).Received(bytes);
+        
+        if (Counters* counters = Find(mConnections, connection))
+            counters->Received(bytes);
+    }
+    
+    // Connections are reported by their label if they have one
+    
+    void Label(uint64_t connection, const char* label)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        mLabels[connection] = label;
+    }
+    
+    // Closed connections give up their label and slot (so that the table does not fill over time)
+    
+    void Release(uint64_t connection)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        mLabels.erase(connection);
+        
+        if (Counters* counters = Find(mConnections, connection))
+        {
+            counters->mNamed = false;
+            counters->Reset();
+            counters->mKey = sReleased;
+        }
+    }
+    
+    // Connection keys for individual clients (these never collide with the other connections)
+    
+    template <class ConnectionID>
+    static uint64_t Key(const ConnectionID& id)
+    {
+        return std::max<uint64_t>(1, std::min<uint64_t>(~0ULL - 3, std::hash<ConnectionID>()(id)));
+    }
+    
+    Snapshot Get() const
+    {
+        Snapshot snapshot;
+        
+        for (int i = 0; i < sNumTags + 1; i++)
+        {
+            if (mTags[i].mKey.load() && mTags[i].mNamed.load())
+                snapshot.mTags.emplace_back(mTags[i].mName, mTags[i].Load());
+        }
+        
+        std::lock_guard<std::mutex> lock(mMutex);
+        
+        for (int i = 0; i < sNumConnections + 1; i++)
+        {
+            if (mConnections[i].mKey.load() && mConnections[i].mNamed.load())
+                snapshot.mConnections.emplace_back(ConnectionName(mConnections[i]), mConnections[i].Load());
+        }
+        
+        return snapshot;
+    }
+    
+    // A dump in the Prometheus text format (the instance is added as a label to every sample)
+    
+    std::string Text(const char* instance) const
+    {
+        Snapshot snapshot = Get();
+        std::string text;
+        
+        std::string escapedInstance = Escape(instance);
+        
+        auto metric = [&](const char* name, const char* label, uint64_t Values::*value, const std::vector<std::pair<std::string, Values>>& entries)
+        {
+            text += std::string("# TYPE ") + name + " counter\n";
+            
+            for (auto it = entries.begin(); it != entries.end(); it++)
+            {
+                text += std::string(name) + "{instance=\"" + escapedInstance + "\"," + label + "=\"" + Escape(it->first) + "\"} ";
+                text += std::to_string(it->second.*value) + "\n";
+            }
+        };
+        
+        metric("network_messages_sent_total", "tag", &Values::mSentMessages, snapshot.mTags);
+        metric("network_bytes_sent_total", "tag", &Values::mSentBytes, snapshot.mTags);
+        metric("network_messages_received_total", "tag", &Values::mReceivedMessages, snapshot.mTags);
+        metric("network_bytes_received_total", "tag", &Values::mReceivedBytes, snapshot.mTags);
+        metric("network_connection_messages_sent_total", "connection", &Values::mSentMessages, snapshot.mConnections);
+        metric("network_connection_bytes_sent_total", "connection", &Values::mSentBytes, snapshot.mConnections);
+        metric("network_connection_messages_received_total", "connection", &Values::mReceivedMessages, snapshot.mConnections);
+        metric("network_connection_bytes_received_total", "connection", &Values::mReceivedBytes, snapshot.mConnections);
+        
+        return text;
+    }
+    
+    // Write the text to a file (replaced atomically so that readers never see a partial dump)
+    
+    bool Write(const char* path, const char* instance) const
+    {
+        std::string text = Text(instance);
+        std::string temp = std::string(path) + ".tmp";
+        
+        FILE* file = fopen(temp.c_str(), "w");
+        
+        if (!file)
+            return false;
+        
+        bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+        
+        if (fclose(file) || !written || rename(temp.c_str(), path))
+        {
+            remove(temp.c_str());
+            return false;
+        }
+        
+        return true;
+    }
+    
+    // Write the text to an open descriptor (e.g. a connected socket)
+    
+    bool Write(int fd, const char* instance) const
+    {
+        std::string text = Text(instance);
+        
+        for (size_t done = 0; done < text.size(); )
+        {
+            ssize_t count = write(fd, text.data() + done, text.size() - done);
+            
+            if (count <= 0)
+                return false;
+            
+            done += static_cast<size_t>(count);
+        }
+        
+        return true;
+    }
+    
+private:
+    
+    struct Counters
+    {
+        std::atomic<uint64_t> mKey { 0 };
+        std::atomic<bool> mNamed { false };
+        char mName[sMaxName] = {};
+        
+        std::atomic<uint64_t> mSentMessages { 0 };
+        std::atomic<uint64_t> mSentBytes { 0 };
+        std::atomic<uint64_t> mReceivedMessages { 0 };
+        std::atomic<uint64_t> mReceivedBytes { 0 };
+        
+        void Sent(size_t bytes)
+        {
+            mSentMessages.fetch_add(1, std::memory_order_relaxed);
+            mSentBytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        
+        void Received(size_t bytes)
+        {
+            mReceivedMessages.fetch_add(1, std::memory_order_relaxed);
+            mReceivedBytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        
+        void Reset()
+        {
+            mSentMessages = 0;
+            mSentBytes = 0;
+            mReceivedMessages = 0;
+            mReceivedBytes = 0;
+        }
+        
+        Values Load() const
+        {
+            Values values;
+            
+            values.mSentMessages = mSentMessages.load(std::memory_order_relaxed);
+            values.mSentBytes = mSentBytes.load(std::memory_order_relaxed);
+            values.mReceivedMessages = mReceivedMessages.load(std::memory_order_relaxed);
+            values.mReceivedBytes = mReceivedBytes.load(std::memory_order_relaxed);
+            
+            return values;
+        }
+    };
+    
+    // Find the slot for a key (searching up to the first empty slot, as released slots may be followed by others)
+    
+    template <int Size>
+    static Counters* Find(Counters (&table)[Size], uint64_t key)
+    {
+        for (int i = 0; i < Size - 1; i++)
+        {
+            Counters& counters = table[(key + i) % (Size - 1)];
+            uint64_t current = counters.mKey.load();
+            
+            if (current == key)
+                return &counters;
+            
+            if (!current)
+                break;
+        }
+        
+        return nullptr;
+    }
+    
+    // Find or claim the slot for a key (keys that do not fit are not given one)
+    // N.B. the name is only written by the claiming thread and is read once it is marked as set
+    
+    template <int Size, class Name>
+    static Counters* Claim(Counters (&table)[Size], uint64_t key, Name name)
+    {
+        while (true)
+        {
+            if (Counters* counters = Find(table, key))
+                return counters;
+            
+            // Claim the first empty or released slot (searching again if another thread claims it first)
+            
+            Counters* slot = nullptr;
+            uint64_t current = 0;
+            
+            for (int i = 0; i < Size - 1 && !slot; i++)
+            {
+                Counters& counters = table[(key + i) % (Size - 1)];
+                current = counters.mKey.load();
+                
+                if (!current || current == sReleased)
+                    slot = &counters;
+            }
+            
+            if (!slot)
+                return nullptr;
+            
+            if (slot->mKey.compare_exchange_strong(current, key))
+            {
+                name(slot->mName);
+                slot->mNamed = true;
+                return slot;
+            }
+        }
+    }
+    
+    template <int Size>
+    static Counters& Overflow(Counters (&table)[Size])
+    {
+        Counters& overflow = table[Size - 1];
+        uint64_t current = 0;
+        
+        if (overflow.mKey.compare_exchange_strong(current, sReleased))
+        {
+            strncpy(overflow.mName, "other", sMaxName - 1);
+            overflow.mNamed = true;
+        }
+        
+        return overflow;
+    }
+    
+    // Tags are never claimed here (only those that have been added are counted by name)
+    // N.B. a tag that is still being added is not yet named and is counted as other
+    
+    Counters& FindTag(const char* tag)
+    {
+        Counters* counters = Find(mTags, Hash(tag));
+        
+        return counters && counters->mNamed.load() && !strncmp(counters->mName, tag, sMaxName - 1) ? *counters : Overflow(mTags);
+    }
+    
+    std::string ConnectionName(const Counters& counters) const
+    {
+        auto it = mLabels.find(counters.mKey.load());
+        
+        return it != mLabels.end() ? it->second : std::string(counters.mName);
+    }
+    
+    // An FNV-1a hash of a tag (never zero or the released key)
+    
+    static uint64_t Hash(const char* str)
+    {
+        uint64_t key = 14695981039346656037ULL;
+        
+        for (; *str; str++)
+            key = (key ^ static_cast<uint8_t>(*str)) * 1099511628211ULL;
+        
+        return key && key != sReleased ? key : 1;
+    }
+    
+    // Label values are escaped as the Prometheus text format requires
+    
+    static std::string Escape(const std::string& value)
+    {
+        std::string escaped;
+        
+        for (auto it = value.begin(); it != value.end(); it++)
+        {
+            if (*it == '\\' || *it == '"')
+                escaped += '\\';
+            
+            if (*it == '\n')
+                escaped += "\\n";
+            else
+                escaped += *it;
+        }
+        
+        return escaped;
+    }
+    
+    Counters mTags[sNumTags + 1];
+    Counters mConnections[sNumConnections + 1];
+    
+    mutable std::mutex mMutex;
+    std::unordered_map<uint64_t, std::string> mLabels;
+};
+
+#endif /* NETWORKMETRICS_HPP */
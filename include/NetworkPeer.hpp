@@ -6,28 +6,66 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <list>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
 #include <thread>
-#include <unordered_set>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "AtomicSnapshot.hpp"
+#include "BeaconPeer.hpp"
 #include "DiscoverablePeer.hpp"
+#include "LatencyProbe.hpp"
+#include "LocalRegistry.hpp"
 #include "NetworkClient.hpp"
 #include "NetworkData.hpp"
+#include "NetworkHub.hpp"
+#include "NetworkMetrics.hpp"
 #include "NetworkServer.hpp"
 #include "NetworkTiming.hpp"
+#include "NetworkTrace.hpp"
 
-class NetworkPeer : private NetworkServer, NetworkClient
+// A peer that acts as either a server or a client (the lock types are taken from the Types policy)
+
+template <class Types = NetworkTypes>
+class NetworkPeerInterface : private NetworkServerInterface<NetworkServerTransport, Types>, NetworkClientInterface<NetworkClientTransport, Types>
 {
+    using Server = NetworkServerInterface<NetworkServerTransport, Types>;
+    using Client = NetworkClientInterface<NetworkClientTransport, Types>;
+    
+    using RecursiveMutex = typename Types::RecursiveMutex;
+    using RecursiveLock = typename Types::RecursiveLock;
+    
+    using Server::StartServer;
+    using Server::StopServer;
+    using Server::NClients;
+    using Server::SendDataToClient;
+    using Server::SendEncodedToClient;
+    using Server::SendDataFromServer;
+    using Server::IsServerConnected;
+    using Server::IsServerRunning;
+    
+    using Client::Connect;
+    using Client::Disconnect;
+    using Client::SendDataFromClient;
+    using Client::SendEncodedFromClient;
+    using Client::IsClientConnected;
+    using Client::Port;
+    
 public:
     
     class DiscoveryThread
     {
     public:
         
-        DiscoveryThread(NetworkPeer& peer, double interval = 1500, double maxPeerTime = 30000)
+        DiscoveryThread(NetworkPeerInterface& peer, double interval = 1500, double maxPeerTime = 30000)
         : mPeer(peer)
         , mExiting(false)
         , mThread([this, interval, maxPeerTime]() { Discovery(interval, maxPeerTime); } )
@@ -76,56 +114,60 @@ public:
             return mCondition.wait_for(lock, duration, [this]() { return !mExiting; });
         }
 
-        NetworkPeer& mPeer;
+        NetworkPeerInterface& mPeer;
         bool mExiting;
         std::condition_variable mCondition;
         std::mutex mMutex;
         std::thread mThread;
     };
 
-    enum class PeerSource { Unresolved, Discovered, Client, Server, Remote };
+    enum class PeerSource { Unresolved, Discovered, Client, Server, Remote, Seed };
+    using DiscoveryMode = ::DiscoveryMode;
     
-    using ConnectionID = NetworkTypes::ConnectionID;
+    using ConnectionID = typename Types::ConnectionID;
 
 private:
     
-    enum class ClientState { Unconfirmed, Confirmed, Failed, Connected };
+    enum class ClientState { Unconfirmed, Failed, Connected };
     
-    // A host (a hostname and port)
+    // A host (a hostname and port with the instance ID of the peer if known)
+    // The name is stored inline so that hosts (and lists of them) are copied without allocating
     
     class Host
     {
     public:
         
-        Host(const char* name, uint16_t port)
+        Host(const char* name, uint16_t port, uint64_t id = 0)
         : mName(name)
         , mPort(port)
+        , mID(id)
         {}
         
-        Host(const WDL_String& name, uint16_t port)
+        Host(const NetworkName& name, uint16_t port, uint64_t id = 0)
         : mName(name)
         , mPort(port)
+        , mID(id)
         {}
         
         Host() : Host("", 0)
         {}
         
-        void UpdatePort(uint16_t port)
-        {
-            mPort = port;
-        }
-        
         bool Empty() const { return !mName.GetLength(); }
         const char *Name() const { return mName.Get(); }
         uint16_t Port() const { return mPort; }
+        uint64_t ID() const { return mID; }
         
     private:
         
-        WDL_String mName;
+        NetworkName mName;
         uint16_t mPort;
+        uint64_t mID;
     };
     
     // A list of peers with timeout information
+    // Writers are serialised by a mutex and publish immutable snapshots that readers load without locking
+    // Snapshots are only rebuilt when the list changes (so readers should hold one rather than copy it)
+    // Peers store when they were last seen so that their times advance without rewriting the list
     
     class PeerList
     {
@@ -137,22 +179,30 @@ private:
         {
         public:
                 
-            Peer(const char* name, uint16_t port, PeerSource source, uint32_t time = 0)
-            : mHost { name, port }
+            Peer(const char* name, uint16_t port, PeerSource source, uint64_t id = 0, uint32_t time = 0)
+            : mHost { name, port, id }
             , mSource(source)
-            , mTime(time)
+            , mSeen(Clock() - time)
+            , mBrowsed(false)
+            , mHasMetadata(false)
             {}
             
-            Peer(const WDL_String& name, uint16_t port, PeerSource source, uint32_t time = 0)
-            : Peer(name.Get(), port, source, time)
+            Peer(const char* name, uint16_t port, PeerSource source, uint64_t id, const BeaconMetadata& metadata)
+            : Peer(name, port, source, id)
+            {
+                UpdateMetadata(metadata);
+            }
+            
+            Peer(const NetworkName& name, uint16_t port, PeerSource source, uint64_t id = 0, uint32_t time = 0)
+            : Peer(name.Get(), port, source, id, time)
             {}
             
             Peer() : Peer(nullptr, 0, PeerSource::Unresolved)
             {}
             
-            void UpdatePort(uint16_t port)
+            void UpdateHost(const Host& host)
             {
-                mHost.UpdatePort(port);
+                mHost = host;
             }
             
             void UpdateSource(PeerSource source)
@@ -162,158 +212,565 @@ private:
             
             void UpdateTime(uint32_t time)
             {
-                mTime = std::min(mTime, time);
+                UpdateSeen(Clock() - time);
+            }
+            
+            void UpdateSeen(uint32_t seen)
+            {
+                if (static_cast<int32_t>(seen - mSeen) > 0)
+                    mSeen = seen;
+            }
+            
+            // Browsed peers have no time and start ageing when discovery stops reporting them
+            
+            void UpdateBrowsed(bool browsed)
+            {
+                if (mBrowsed && !browsed)
+                    mSeen = Clock();
+                
+                mBrowsed = browsed;
+                
+                if (!browsed)
+                    mHasMetadata = false;
             }
             
-            void AddTime(uint32_t add)
+            void UpdateMetadata(const BeaconMetadata& metadata)
             {
-                mTime += add;
+                mMetadata = metadata;
+                mHasMetadata = true;
             }
             
+            const Host& GetHost() const { return mHost; }
             const char *Name() const { return mHost.Name(); }
             uint16_t Port() const { return mHost.Port(); }
+            uint64_t ID() const { return mHost.ID(); }
             PeerSource Source() const { return mSource; }
-            uint32_t Time() const { return mTime; }
+            uint32_t Seen() const { return mSeen; }
+            uint32_t Time() const { return Time(Clock()); }
+            uint32_t Time(uint32_t now) const { return mBrowsed ? 0 : now - mSeen; }
             
             bool IsClient() const { return mSource == PeerSource::Client; }
             bool IsUnresolved() const { return mSource == PeerSource::Unresolved; }
+            bool IsBrowsed() const { return mBrowsed; }
+            bool HasMetadata() const { return mHasMetadata; }
+            const BeaconMetadata& Metadata() const { return mMetadata; }
+            
+            // Peers match if they differ only in being seen less than the given time apart
+            
+            bool Matches(const Peer& a, uint32_t seenTolerance) const
+            {
+                bool sameMetadata = mMetadata.mLoad == a.mMetadata.mLoad
+                                 && mMetadata.mProtocolVersion == a.mMetadata.mProtocolVersion
+                                 && mMetadata.mCapabilities == a.mMetadata.mCapabilities;
+                
+                uint32_t seenDifference = std::max(mSeen - a.mSeen, a.mSeen - mSeen);
+                
+                return ID() == a.ID() && Port() == a.Port() && mSource == a.mSource && seenDifference < seenTolerance && mBrowsed == a.mBrowsed
+                    && mHasMetadata == a.mHasMetadata && sameMetadata && !strcmp(Name(), a.Name());
+            }
+            
+            // A millisecond clock (wrapping differences give times)
+            
+            static uint32_t Clock()
+            {
+                using namespace std::chrono;
+                
+                return static_cast<uint32_t>(duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count());
+            }
             
         private:
             
             Host mHost;
             PeerSource mSource;
-            uint32_t mTime;
+            uint32_t mSeen;
+            bool mBrowsed;
+            bool mHasMetadata;
+            BeaconMetadata mMetadata;
         };
                 
-        using ListType = std::list<Peer>;
+        using ListType = std::vector<Peer>;
+        using Snapshot = typename AtomicSnapshot<ListType>::Pointer;
 
         void Add(const Peer& peer)
         {
             RecursiveLock lock(&mMutex);
 
-            auto findTest = [&](const Peer& a) { return !strcmp(a.Name(), peer.Name()); };
-            auto it = std::find_if(mPeers.begin(), mPeers.end(), findTest);
+            AddPeer(peer);
+            Publish();
+        }
+        
+        // Add a batch of peers (publishing once)
+        
+        void Add(const ListType& peers)
+        {
+            RecursiveLock lock(&mMutex);
+            
+            for (auto it = peers.begin(); it != peers.end(); it++)
+                AddPeer(*it);
+            
+            Publish();
+        }
+        
+        // Browsed peers are kept alive for as long as discovery reports them
+        
+        void Browse(const Peer& peer)
+        {
+            RecursiveLock lock(&mMutex);
+            
+            AddPeer(peer)->UpdateBrowsed(true);
+            Publish();
+        }
+        
+        void Unbrowse(const Peer& peer)
+        {
+            RecursiveLock lock(&mMutex);
+            
+            auto it = Find(peer);
+            
+            if (it != mPeers.end())
+            {
+                it->UpdateBrowsed(false);
+                Publish();
+            }
+        }
+        
+        // Update the times for a batch of peers known by instance ID (publishing once)
+        
+        void Refresh(const std::vector<std::pair<uint64_t, uint32_t>>& times)
+        {
+            RecursiveLock lock(&mMutex);
+            
+            std::unordered_map<uint64_t, uint32_t> seen;
+            uint32_t now = Peer::Clock();
+            
+            for (auto it = times.begin(); it != times.end(); it++)
+            {
+                if (it->first)
+                    seen[it->first] = now - it->second;
+            }
+            
+            for (auto it = mPeers.begin(); it != mPeers.end(); it++)
+            {
+                auto jt = seen.find(it->ID());
+                
+                if (jt != seen.end())
+                    it->UpdateSeen(jt->second);
+            }
+            
+            Publish();
+        }
+        
+        // Remove peers that have not been seen for the max time
+        // Snapshot times may lag by a fraction of this (so that times alone rarely rebuild the snapshot)
+        
+        void Prune(uint32_t maxTime)
+        {
+            RecursiveLock lock(&mMutex);
+            
+            uint32_t now = Peer::Clock();
+            auto size = mPeers.size();
+            
+            mPeers.erase(std::remove_if(mPeers.begin(), mPeers.end(), [&](const Peer& a) { return a.Time(now) >= maxTime; }), mPeers.end());
+            mSeenTolerance = std::max(maxTime / 8, 1U);
+            
+            if (size != mPeers.size())
+            {
+                mVersion++;
+                Publish();
+            }
+        }
+        
+        // Readers (these never lock)
+        
+        Snapshot Get() const
+        {
+            return mSnapshot.Load();
+        }
+        
+        int Size() const
+        {
+            return mSize;
+        }
+        
+        // The version changes whenever peers are added, removed or change address
+        
+        uint64_t Version() const
+        {
+            return mVersion;
+        }
+        
+    private:
+        
+        void Publish()
+        {
+            auto snapshot = mSnapshot.Load();
+            auto matches = [&](const Peer& a, const Peer& b) { return a.Matches(b, mSeenTolerance); };
+            
+            if (std::equal(snapshot->begin(), snapshot->end(), mPeers.begin(), mPeers.end(), matches))
+                return;
+            
+            mSnapshot.Store(std::make_shared<const ListType>(mPeers));
+            mSize = static_cast<int>(mPeers.size());
+        }
+        
+        // Peers are identified by instance ID where known and otherwise by name and port
+        // Entries found without an ID are adopted by a matching peer that has one
+        
+        typename ListType::iterator Find(const Peer& peer)
+        {
+            auto sameID = [&](const Peer& a) { return a.ID() == peer.ID(); };
+            auto sameHost = [&](const Peer& a) { return a.Port() == peer.Port() && !strcmp(a.Name(), peer.Name()); };
+            
+            if (!peer.ID())
+                return std::find_if(mPeers.begin(), mPeers.end(), sameHost);
+            
+            auto it = std::find_if(mPeers.begin(), mPeers.end(), sameID);
+            
+            if (it != mPeers.end())
+                return it;
+            
+            return std::find_if(mPeers.begin(), mPeers.end(), [&](const Peer& a) { return !a.ID() && sameHost(a); });
+        }
+        
+        typename ListType::iterator AddPeer(const Peer& peer)
+        {
+            auto it = Find(peer);
             
             // Add host in order or update details
             
             if (it == mPeers.end())
             {
                 auto insertTest = [&](const Peer& a) { return !NamePrefer(a.Name(), peer.Name()); };
-                mPeers.insert(std::find_if(mPeers.begin(), mPeers.end(), insertTest), peer);
+                mVersion++;
+                return mPeers.insert(std::find_if(mPeers.begin(), mPeers.end(), insertTest), peer);
             }
-            else
+            
+            if (peer.ID() && (it->ID() != peer.ID() || it->Port() != peer.Port() || strcmp(it->Name(), peer.Name())))
+            {
+                it->UpdateHost(peer.GetHost());
+                mVersion++;
+            }
+            
+            it->UpdateSource(peer.Source());
+            it->UpdateSeen(peer.Seen());
+            
+            if (peer.HasMetadata())
+                it->UpdateMetadata(peer.Metadata());
+            
+            return it;
+        }
+        
+        mutable RecursiveMutex mMutex;
+        ListType mPeers;
+        AtomicSnapshot<ListType> mSnapshot;
+        std::atomic<int> mSize { 0 };
+        std::atomic<uint64_t> mVersion { 0 };
+        uint32_t mSeenTolerance = 1;
+    };
+    
+    // A list of fully confirmed clients (with the identity each provided on confirmation and its link measurements)
+    // Writers are serialised by a mutex and readers use the published map and count without locking
+    
+    class ClientList
+    {
+    public:
+        
+        // Round trip times are smoothed as for TCP (with a gain of 1/8) and loads are a percentage of the host's threads
+        // Links are the round trips that the client has probed to other peers
+        
+        struct Client
+        {
+            Host mHost;
+            double mRTT = 0.0;
+            int mSamples = 0;
+            uint32_t mLoad = 0;
+            LatencyProbe::Links mLinks {};
+        };
+        
+        using MapType = std::unordered_map<ConnectionID, Client>;
+        using Snapshot = typename AtomicSnapshot<MapType>::Pointer;
+        
+        void Add(ConnectionID id, const Host& host)
+        {
+            Add(id, Client { host });
+        }
+        
+        void Add(ConnectionID id, const Client& client)
+        {
+            RecursiveLock lock(&mMutex);
+            
+            mClients[id] = client;
+            Publish();
+        }
+        
+        void UpdateLink(ConnectionID id, double rtt, uint32_t load)
+        {
+            RecursiveLock lock(&mMutex);
+            
+            auto it = mClients.find(id);
+            
+            if (it != mClients.end())
             {
-                it->UpdatePort(peer.Port());
-                it->UpdateSource(peer.Source());
-                it->UpdateTime(peer.Time());
+                Client& client = it->second;
+                
+                client.mRTT = client.mSamples ? client.mRTT + (rtt - client.mRTT) / 8.0 : rtt;
+                client.mSamples++;
+                client.mLoad = load;
+                Publish();
             }
         }
         
-        void Prune(uint32_t maxTime, uint32_t addTime = 0)
+        void UpdateLinks(ConnectionID id, const LatencyProbe::Links& links)
         {
             RecursiveLock lock(&mMutex);
-
-            // Added time to hosts if required
             
-            if (addTime)
+            auto it = mClients.find(id);
+            
+            if (it != mClients.end())
             {
-                for (auto it = mPeers.begin(); it != mPeers.end(); it++)
-                    it->AddTime(addTime);
+                it->second.mLinks = links;
+                Publish();
             }
-              
-            // Remove if max time is exceeded
+        }
+        
+        void Remove(ConnectionID id)
+        {
+            RecursiveLock lock(&mMutex);
             
-            mPeers.remove_if([&](const Peer& a) { return a.Time() >= maxTime; });
+            if (mClients.erase(id))
+                Publish();
         }
         
-        void Get(ListType& list) const
+        void Clear()
         {
             RecursiveLock lock(&mMutex);
-
-            list = mPeers;
+            
+            mClients.clear();
+            Publish();
+        }
+        
+        bool Identity(ConnectionID id, Host& host) const
+        {
+            Client client;
+            
+            if (!Find(id, client))
+                return false;
+            
+            host = client.mHost;
+            return true;
+        }
+        
+        bool Find(ConnectionID id, Client& client) const
+        {
+            auto clients = mSnapshot.Load();
+            auto it = clients->find(id);
+            
+            if (it == clients->end())
+                return false;
+            
+            client = it->second;
+            return true;
+        }
+        
+        Snapshot Get() const
+        {
+            return mSnapshot.Load();
         }
         
         int Size() const
         {
-            RecursiveLock lock(&mMutex);
-
-            return static_cast<int>(mPeers.size());
+            return mSize;
         }
         
     private:
         
+        void Publish()
+        {
+            mSnapshot.Store(std::make_shared<const MapType>(mClients));
+            mSize = static_cast<int>(mClients.size());
+        }
+        
         mutable RecursiveMutex mMutex;
-        ListType mPeers;
+        MapType mClients;
+        AtomicSnapshot<MapType> mSnapshot;
+        std::atomic<int> mSize { 0 };
     };
     
-    // A list of fully confirmed clients
+    // Resumption tokens issued to confirmed clients (so that a client can regain its place in a single message)
+    // Tokens are single use and last until a short time after their connection closes
     
-    class ClientList : private std::unordered_set<ConnectionID>
+    class ResumeTokens
     {
+        static constexpr double sExpiry = 30.0;
+        
+        struct Entry
+        {
+            ConnectionID mConnection;
+            typename ClientList::Client mClient;
+            CPUTimer mClosed;
+            bool mConnected;
+        };
+        
     public:
         
-        void Add(ConnectionID id)
+        uint64_t Issue(ConnectionID id, const typename ClientList::Client& client)
         {
             RecursiveLock lock(&mMutex);
             
-            insert(id);
+            uint64_t token = RandomID();
+            
+            // Any earlier token for the same client is replaced
+            
+            Purge([&](const Entry& a) { return a.mClient.mHost.ID() == client.mHost.ID(); });
+            mTokens[token] = Entry { id, client, CPUTimer(), true };
+            
+            return token;
         }
         
-        void Remove(ConnectionID id)
+        // The latest link measurements are kept with the token
+        
+        void Closed(ConnectionID id, const typename ClientList::Client& client)
         {
             RecursiveLock lock(&mMutex);
             
-            erase(id);
+            for (auto it = mTokens.begin(); it != mTokens.end(); it++)
+            {
+                if (it->second.mConnected && it->second.mConnection == id)
+                {
+                    it->second.mClient = client;
+                    it->second.mClosed.Start();
+                    it->second.mConnected = false;
+                }
+            }
         }
         
-        void Clear()
+        bool Redeem(uint64_t token, uint64_t clientID, typename ClientList::Client& client)
         {
             RecursiveLock lock(&mMutex);
             
-            clear();
+            Purge([](const Entry& a) { return false; });
+            
+            auto it = mTokens.find(token);
+            
+            if (!token || it == mTokens.end() || it->second.mClient.mHost.ID() != clientID)
+                return false;
+            
+            client = it->second.mClient;
+            mTokens.erase(it);
+            
+            return true;
         }
         
-        int Size() const
+        void Clear()
         {
             RecursiveLock lock(&mMutex);
             
-            return static_cast<int>(size());
+            mTokens.clear();
         }
         
     private:
         
+        template <class Test>
+        void Purge(Test test)
+        {
+            for (auto it = mTokens.begin(); it != mTokens.end(); )
+            {
+                if (test(it->second) || (!it->second.mConnected && it->second.mClosed.Interval() > sExpiry))
+                    it = mTokens.erase(it);
+                else
+                    it++;
+            }
+        }
+        
         mutable RecursiveMutex mMutex;
+        std::unordered_map<uint64_t, Entry> mTokens;
     };
     
-    // A class for storing info about the next server a peer should connect to
+    // A class for storing info about the next server a peer should connect to (readers do not lock)
+    // N.B. the host expires after the given number of seconds
     
     class NextServer
     {
+        struct Entry
+        {
+            Host mHost;
+            CPUTimer mTimeOut;
+        };
+        
     public:
         
+        NextServer(double timeOut = 4.0) : mTimeOut(timeOut)
+        {}
+        
         void Set(const Host& host)
         {
             RecursiveLock lock(&mMutex);
 
-            mHost = host;
-            mTimeOut.Start();
+            mEntry.Store(std::make_shared<const Entry>(Entry { host, CPUTimer() }));
         }
         
         Host Get() const
         {
-            RecursiveLock lock(&mMutex);
+            auto entry = mEntry.Load();
 
-            if (mTimeOut.Interval() > 4)
+            if (entry->mTimeOut.Interval() > mTimeOut)
                 return Host();
             else
-                return mHost;
+                return entry->mHost;
+        }
+        
+        // Get the host and clear it (so that it is only used once)
+        
+        Host Take()
+        {
+            RecursiveLock lock(&mMutex);
+            
+            Host host = Get();
+            Set(Host());
+            
+            return host;
+        }
+        
+    private:
+        
+        const double mTimeOut;
+        mutable RecursiveMutex mMutex;
+        AtomicSnapshot<Entry> mEntry;
+    };
+    
+    // A class for storing servers that recently turned us away for being full (so that they are not retried)
+    
+    class FullServers
+    {
+        static constexpr double sExpiry = 30.0;
+        
+    public:
+        
+        void Add(uint64_t id)
+        {
+            RecursiveLock lock(&mMutex);
+            
+            auto expired = [](const std::pair<uint64_t, CPUTimer>& a) { return a.second.Interval() > sExpiry; };
+            
+            mServers.erase(std::remove_if(mServers.begin(), mServers.end(), expired), mServers.end());
+            
+            if (id)
+                mServers.emplace_back(id, CPUTimer());
+        }
+        
+        bool Contains(uint64_t id) const
+        {
+            RecursiveLock lock(&mMutex);
+            
+            auto same = [&](const std::pair<uint64_t, CPUTimer>& a) { return a.first == id && a.second.Interval() <= sExpiry; };
+            
+            return id && std::any_of(mServers.begin(), mServers.end(), same);
         }
         
     private:
         
         mutable RecursiveMutex mMutex;
-        Host mHost;
-        CPUTimer mTimeOut;
+        std::vector<std::pair<uint64_t, CPUTimer>> mServers;
     };
     
 public:
@@ -322,52 +779,166 @@ public:
     
     struct PeerInfo
     {
-        PeerInfo(const char* name, uint16_t port, PeerSource source, uint32_t time)
+        PeerInfo(const char* name, uint16_t port, uint64_t id, PeerSource source, uint32_t time)
         : mName(name)
         , mPort(port)
+        , mID(id)
         , mSource(source)
         , mTime(time)
         {}
         
         WDL_String mName;
         uint16_t mPort;
+        uint64_t mID;
         PeerSource mSource;
         uint32_t mTime;
     };
     
-    NetworkPeer(const char *regname, uint16_t port = 8001)
+    // Discovery statistics structure (shared by all peers using the same hub)
+    
+    using DiscoveryStats = NetworkHub::Stats;
+    
+    // N.B. with several instances on one host each listens on the given port offset by its registry slot
+    // Instances in one process share a single hub for Bonjour and beacon discovery
+    
+    NetworkPeerInterface(const char *regname, uint16_t port = 8001, DiscoveryMode mode = DiscoveryMode::Bonjour)
     : mClientState(ClientState::Unconfirmed)
-    , mDiscoverable(DiscoverablePeer::GetStaticHostName().Get(), regname, port)
-    {}
+    , mServerID(0)
+    , mStopServing(false)
+    , mDiscoveryMode(mode)
+    , mHostName(DiscoverablePeer::GetStaticHostName())
+    , mInstanceID(RandomID())
+    , mRegistry(regname, mInstanceID, port)
+    , mHub(NetworkHub::Get(regname, mode))
+    , mLatencyProbe(mInstanceID)
+    , mMetrics(MetricsTags())
+    {
+        SetDiscoveryHandlers(mRegistry);
+        mLatencyProbe.Start(ServerPort());
+        mHub->SetProtocol(GetProtocolVersion(), GetCapabilities());
+        mHub->Attach(this, ServerPort(), mInstanceID, { HubHandlers<bonjour_service>(), HubHandlers<BeaconService>() });
+        
+        // The last confirmed server is negotiated with on the first discovery pass
+        
+        mLastServerPath = DefaultLastServerPath(regname, ServerPort());
+        LoadLastServer();
+    }
     
-    ~NetworkPeer()
+    ~NetworkPeerInterface()
     {
-        mDiscoverable.Stop();
-        StopServer();
+        StopEventSources();
     }
     
     WDL_String GetHostName() const
     {
-        return mDiscoverable.GetHostName();
+        return UsesBonjour() ? mHub->GetHostName() : mHostName;
     }
     
-    // Peer status (these do not correspond directly to the state of NstworkServer and NetworkClient
+    uint64_t GetInstanceID() const
+    {
+        return mInstanceID;
+    }
     
-    bool IsConnectedAsServer() const { return mConfirmedClients.Size(); }
-    bool IsConnectedAsClient() const  { return IsClientConnected() && mClientState == ClientState::Connected; }
-    bool IsDisconnected() const { return !IsConnectedAsServer() && !IsConnectedAsClient(); }
+    // Seeds are static peers that are always tried (in order of preference) alongside discovered peers
     
-    void Discover(uint32_t interval, uint32_t maxPeerTime)
+    void AddSeed(const char* host, uint16_t port = 8001)
     {
-        if (IsClientConnected())
-        {
+        if (!IsSelf(host, port, 0))
+            mPeers.Browse({host, port, PeerSource::Seed});
+    }
+    
+    // Limit the number of clients (zero for no limit) - further clients are redirected to a server with room if possible
+    // N.B. current clients are never removed (so lowering the limit only affects new clients)
+    
+    void SetMaxClients(int max)
+    {
+        mMaxClients = std::max(0, max);
+    }
+    
+    // Servers hand the session over to a client with lower estimated latency to the others (unless this is disabled)
+    
+    void SetLatencyElection(bool enable)
+    {
+        mLatencyElection = enable;
+    }
+    
+    // The last server record is written by the discovery pass after a connection is confirmed (an empty path disables it)
+    // By default each registry slot has its own record in the user's runtime (or home) directory
+    // N.B. a server loaded from the previous path is forgotten
+    
+    void SetLastServerPath(const char* path)
+    {
+        mLastServerPath.Set(path);
+        mLastServer.Set(Host());
+        LoadLastServer();
+    }
+    
+    // Inbound events as both server and client are written to the capture whilst one is set
+    
+    void SetCapture(NetworkCapture* capture)
+    {
+        Server::SetServerCapture(capture);
+        Client::SetClientCapture(capture);
+    }
+    
+    // Captured events may be replayed directly into the handlers (see NetworkReplay)
+    
+    using Server::ReplayServerEvent;
+    using Client::ReplayClientEvent;
+    
+    // Servers on this host are connected through the local transport unless this is disabled
+    
+    void SetLocalTransport(bool use)
+    {
+        Client::SetLocalTransport(use);
+    }
+    
+    // Beacons are sent on the default multicast interface unless set otherwise (e.g. "127.0.0.1" for loopback)
+    
+    void SetBeaconInterface(const char* address)
+    {
+        mHub->SetBeaconInterface(address);
+    }
+    
+    // Drive discovery from the shared hub thread (an alternative to a DiscoveryThread per peer)
+    // Discovery is driven until the returned handle is released (hold it alongside the peer and declare it after the peer)
+    
+    [[nodiscard]] NetworkHub::Driver StartSharedDiscovery(double interval = 1500, double maxPeerTime = 30000)
+    {
+        return mHub->Drive(this, [this, interval, maxPeerTime]() { Discover(interval, maxPeerTime); }, interval);
+    }
+    
+    // Peer status (these do not correspond directly to the state of NstworkServer and NetworkClient
+    
+    bool IsConnectedAsServer() const { return mConfirmedClients.Size(); }
+    bool IsConnectedAsClient() const  { return IsClientConnected() && mClientState == ClientState::Connected; }
+    bool IsDisconnected() const { return !IsConnectedAsServer() && !IsConnectedAsClient(); }
+    
+    void Discover(uint32_t interval, uint32_t maxPeerTime)
+    {
+        NetworkTrace::Scope trace("discovery", "pass", mInstanceID);
+        
+        mRegistry.Heartbeat(mConfirmedClients.Size(), GetProtocolVersion(), GetCapabilities());
+        StoreLastServer();
+        
+        if (IsClientConnected())
+        {
             if (mClientState != ClientState::Failed)
             {
-                if (mClientState == ClientState::Confirmed)
-                    ClientConnectionConfirmed();
+                StopServing();
+                
+                WDL_String server = Client::GetServerName();
+                uint16_t port = Port();
+                
+                // N.B. a connection that closes during the pass has no name (which must not replace the server's entry)
+                
+                if (server.GetLength() && port)
+                    mPeers.Add({server.Get(), port, PeerSource::Server, mServerID});
                 
-                mPeers.Add({NetworkClient::GetServerName().Get(), Port(), PeerSource::Server});
-                mPeers.Prune(maxPeerTime, interval);
+                if (mClientState == ClientState::Connected)
+                    ReportLinks();
+                
+                mPeers.Prune(maxPeerTime);
                 return;
             }
             else
@@ -380,82 +951,84 @@ public:
         
         if (!nextHost.Empty())
         {
-            TryConnect(nextHost.Name(), nextHost.Port(), true);
-            mPeers.Prune(maxPeerTime, interval);
+            TryConnect(nextHost, true);
+            mPeers.Prune(maxPeerTime);
+            return;
+        }
+        
+        // Negotiate with the last confirmed server once (so that a stale record costs a single attempt)
+        
+        auto lastHost = mLastServer.Take();
+        
+        if (!lastHost.Empty() && TryConnect(lastHost))
+        {
+            mPeers.Prune(maxPeerTime);
             return;
         }
         
         // Check that the server is running
         
         if (!IsServerRunning())
-            StartServer(mDiscoverable.Port());
+            StartServer(ServerPort());
         
         // Check that discoverability is on
         
-        if (!mDiscoverable.IsRunning())
+        if (!IsDiscoveryRunning())
         {
-            mDiscoverable.Start();
-            mBonjourRestart.Start();
+            StartDiscovery();
+            mDiscoveryIdle.Start();
         }
         
-        // Update the list of peers
-        
-        auto foundPeers = mDiscoverable.FindPeers();
+        // Update the list of peers (only differences since the last pass are processed)
         
-        for (auto it = foundPeers.begin(); it != foundPeers.end(); it++)
-        {
-            // Make sure we conform the name correctly if the host is not resolved
-            
-            bool unresolved = it->host().empty();
-            std::string host = unresolved ? it->name() : it->host();
-            PeerSource source = unresolved ? PeerSource::Unresolved : PeerSource::Discovered;
-            
-            if (unresolved)
-            {
-                std::string end("-local");
-                
-                auto pos = host.length() - end.length();
-                
-                if (host.find(end, pos) != std::string::npos)
-                {
-                    host.resize(pos);
-                    host.append(".local.");
-                }
-            }
-            
-            mPeers.Add({host.c_str(), it->port(), source});
-        }
+        FindPeers();
             
         // Try to connect to any available servers in order of preference
                 
-        PeerList::ListType peers;
-        mPeers.Get(peers);
+        auto peers = mPeers.Get();
+        auto candidates = RankCandidates(*peers);
         
-        for (auto it = peers.begin(); it != peers.end(); it++)
+        for (auto it = candidates.begin(); it != candidates.end(); it++)
         {
+            const typename PeerList::Peer& peer = **it;
+            
             // Don't attempt to connect to clients, unresolved hosts or to self connect
             
-            if (it->IsClient() || it->IsUnresolved() || IsSelf(it->Name()))
+            if (peer.IsClient() || peer.IsUnresolved() || IsSelf(peer.Name(), peer.Port(), peer.ID()))
                 continue;
-            
-                // Connect or resolve
                 
-            if (TryConnect(it->Name(), it->Port()))
+                // Connect or resolve
+            
+            if (TryConnect(peer.GetHost()))
                 break;
-            else
-                mDiscoverable.Resolve(it->Name());
+            else if (UsesBonjour())
+                mHub->Resolve(peer.Name());
+        }
+        
+        // Discovery persists and is only restarted if it fails to produce a connection (with backoff)
+        
+        if (IsServerConnected() || IsClientConnected())
+        {
+            mDiscoveryIdle.Start();
+            mDiscoveryBackoff = sDiscoveryInitialBackoff;
+        }
+        else if (mDiscoveryIdle.Interval() > mDiscoveryBackoff)
+        {
+            DBGMSG("PEER: Discovery idle for %.0lf seconds - restarting\n", mDiscoveryIdle.Interval());
+            
+            StopDiscovery();
+            mDiscoveryBackoff = std::min(sDiscoveryMaxBackoff, mDiscoveryBackoff * 2.0);
         }
         
-        if (mBonjourRestart.Interval() > 15)
-            mDiscoverable.Stop();
-                
         if (IsServerConnected())
         {
             SendPeerList();
             PingClients();
+            ProbeClients();
+            ConsiderHandover();
         }
         
-        mPeers.Prune(maxPeerTime, interval);
+        mPeers.Prune(maxPeerTime);
     }
     
     WDL_String GetServerName() const
@@ -474,292 +1047,1207 @@ public:
                 str.AppendFormatted(256, " [%d]", clients);
 
             if (IsClientConnected())
-                str.AppendFormatted(256, " [%s]", NetworkClient::GetServerName().Get());
+                str.AppendFormatted(256, " [%s]", Client::GetServerName().Get());
         }
         else if (IsClientConnected())
-            str = NetworkClient::GetServerName();
+            str = Client::GetServerName();
         else
             str.Set("Disconnected");
         
         return str;
     }
     
+    // Discovery statistics (for measuring mDNS traffic and peer list churn)
+    
+    DiscoveryStats GetDiscoveryStats() const
+    {
+        DiscoveryStats stats = mHub->GetStats();
+        
+        stats.mChurn += mRegistry.Churn();
+        
+        return stats;
+    }
+    
     std::vector<PeerInfo> GetPeerInfo() const
     {
         std::vector<PeerInfo> info;
         
-        PeerList::ListType peers;
-        mPeers.Get(peers);
+        auto peers = mPeers.Get();
         
-        for (auto it = peers.begin(); it != peers.end(); it++)
-            info.emplace_back(it->Name(), it->Port(), it->Source(), it->Time());
+        for (auto it = peers->begin(); it != peers->end(); it++)
+            info.emplace_back(it->Name(), it->Port(), it->ID(), it->Source(), it->Time());
         
         return info;
     }
     
-    template <class ...Args>
-    void SendToClient(ws_connection_id id, const Args& ...args)
+    // Message and byte counts by tag and by connection (the text is in the Prometheus format)
+    
+    NetworkMetrics::Snapshot GetMetrics() const
     {
-        SendTaggedToClient(GetDataTag(), id, std::forward<const Args>(args)...);
+        return mMetrics.Get();
     }
     
-    template <class ...Args>
-    void SendFromServer(const Args& ...args)
+    std::string GetMetricsText() const
     {
-        SendTaggedFromServer(GetDataTag(), std::forward<const Args>(args)...);
+        return mMetrics.Text(MetricsInstance().c_str());
     }
     
-    template <class ...Args>
-    void SendFromClient(const Args& ...args)
+    bool WriteMetrics(const char* path) const
     {
-        SendTaggedFromClient(GetDataTag(), std::forward<const Args>(args)...);
+        return mMetrics.Write(path, MetricsInstance().c_str());
     }
-
-private:
     
-    static bool NamePrefer(const char* name1, const char* name2)
+    bool WriteMetrics(int fd) const
     {
-        return strcmp(name1, name2) < 0;
+        return mMetrics.Write(fd, MetricsInstance().c_str());
     }
     
-    bool IsSelf(const char* peerName) const
+    // User data is counted in the metrics by its first element if that is a string added here (and otherwise as other)
+    
+    void AddMetricsTag(const char* tag)
     {
-        WDL_String host = GetHostName();
-        
-        return !strcmp(host.Get(), peerName);
+        mMetrics.AddTag(tag);
     }
-        
-    void WaitToStop()
+    
+    template <class ...Args>
+    void SendToClient(ws_connection_id id, const Args& ...args)
     {
-        std::chrono::duration<double, std::milli> ms(500);
-        std::this_thread::sleep_for(ms);
+        SendTaggedToClient(GetDataTag(), DataMetric(args...), id, std::forward<const Args>(args)...);
     }
     
-    constexpr static const char *GetConnectionTag()
+    template <class ...Args>
+    void SendFromServer(const Args& ...args)
     {
-        return "~";
+        SendTaggedFromServer(GetDataTag(), DataMetric(args...), std::forward<const Args>(args)...);
     }
     
-    constexpr static const char *GetDataTag()
+    template <class ...Args>
+    void SendFromClient(const Args& ...args)
     {
-        return "-";
+        SendTaggedFromClient(GetDataTag(), DataMetric(args...), std::forward<const Args>(args)...);
     }
     
-    template <class ...Args>
-    void SendConnectionDataToClient(ws_connection_id id, const Args& ...args)
+protected:
+    
+    // Detach from the shared hub and stop both transports (so that no further events arrive for this peer)
+    // N.B. this is called on destruction but derived classes that handle events should call it before they are destroyed
+    
+    void StopEventSources()
     {
-        SendTaggedToClient(GetConnectionTag(), id, std::forward<const Args>(args)...);
+        mHub->Detach(this);
+        StopServer();
+        Disconnect();
     }
+
+private:
     
-    template <class ...Args>
-    void SendConnectionDataFromServer(const Args& ...args)
+    bool UsesBonjour() const { return mDiscoveryMode != DiscoveryMode::Beacon; }
+    bool UsesBeacon() const { return mDiscoveryMode != DiscoveryMode::Bonjour; }
+    
+    template <class Discovery>
+    void SetDiscoveryHandlers(Discovery& discovery)
+    {
+        using Service = typename Discovery::Service;
+        
+        auto added = [this](const Service& service) { BrowseService(service); };
+        auto removed = [this](const Service& service) { UnbrowseService(service); };
+        auto changed = [this](const Service& previous, const Service& current)
+        {
+            UnbrowseService(previous);
+            BrowseService(current);
+        };
+        
+        discovery.SetHandlers(added, removed, changed, added);
+    }
+    
+    // Hub handlers run on whichever thread is driving the hub (so they are deferred as for transport events if required)
+    
+    template <class Service>
+    NetworkHub::ServiceHandlers<Service> HubHandlers()
     {
-        SendTaggedFromServer(GetConnectionTag(), std::forward<const Args>(args)...);
+        auto added = [this](const Service& service) { HandleHubEvent([this, service]() { BrowseService(service); }); };
+        auto removed = [this](const Service& service) { HandleHubEvent([this, service]() { UnbrowseService(service); }); };
+        
+        return { added, removed, added };
     }
     
-    template <class ...Args>
-    void SendConnectionDataFromClient(const Args& ...args)
+    template <class Event>
+    void HandleHubEvent(Event&& event)
     {
-        SendTaggedFromClient(GetConnectionTag(), std::forward<const Args>(args)...);
+        if (Types::sDeferEvents)
+            Dispatch(std::forward<Event>(event));
+        else
+            event();
     }
-
-    template <class ...Args>
-    void SendTaggedToClient(const char *tag, ws_connection_id id, const Args& ...args)
+    
+    // Deferred events are passed here (this overrides both the server and client versions so one override serves both)
+    
+    void Dispatch(std::function<void()>&& event) override
     {
-        SendDataToClient(id, NetworkByteChunk(tag, std::forward<const Args>(args)...));
+        event();
     }
     
-    template <class ...Args>
-    void SendTaggedFromServer(const char *tag, const Args& ...args)
+    bool IsDiscoveryRunning() const
     {
-        SendDataFromServer(NetworkByteChunk(tag, std::forward<const Args>(args)...));
+        return mHub->IsDiscoveryRunning(this);
     }
     
-    template <class ...Args>
-    void SendTaggedFromClient(const char *tag, const Args& ...args)
+    void StartDiscovery()
     {
-        SendDataFromClient(NetworkByteChunk(tag, std::forward<const Args>(args)...));
+        mHub->StartDiscovery(this);
     }
     
-    void OnServerDisconnect(ConnectionID id) override
+    void StopDiscovery()
     {
-        mConfirmedClients.Remove(id);
+        mHub->StopDiscovery(this);
     }
     
-    void ClientConnectionConfirmed()
+    void FindPeers()
     {
-        WDL_String server = NetworkClient::GetServerName();
+        // Peers on this host are found first (through the registry)
         
-        SendConnectionDataFromClient("Confirm");
-        SendConnectionDataFromServer("Switch", server, Port());
-        
-        mClientState = ClientState::Connected;
-
-        WaitToStop();
-        mDiscoverable.Stop();
-        StopServer();
-        mConfirmedClients.Clear();
+        mRegistry.FindPeers();
+        mHub->FindPeers(this, mConfirmedClients.Size());
     }
     
-    bool TryConnect(const char *host, uint16_t port, bool direct = false)
+    // Peers with metadata are ranked using the same rules as the "Negotiate" election
+    // Those that would reject us (or speak another protocol) are dropped and the rest are tried first
+    // Candidates point into the given snapshot (so that the peers themselves are not copied)
+    
+    std::vector<const typename PeerList::Peer *> RankCandidates(const typename PeerList::ListType& peers) const
     {
-        if (Connect(host, port))
+        const uint32_t numClientsLocal = mConfirmedClients.Size();
+        
+        auto rejects = [&](const typename PeerList::Peer *a)
         {
-            if (!direct)
-            {
-                mClientState = ClientState::Unconfirmed;
-                WDL_String host = GetHostName();
-                uint16_t port = Port();
+            if (mFullServers.Contains(a->ID()))
+                return true;
             
-                SendConnectionDataFromClient("Negotiate", host, port, mConfirmedClients.Size());
-            }
-            else
-                ClientConnectionConfirmed();
+            if (!a->HasMetadata())
+                return false;
             
-            return true;
+            const BeaconMetadata& metadata = a->Metadata();
+            
+            if (metadata.mProtocolVersion != GetProtocolVersion())
+                return true;
+            
+            bool prefer = metadata.mLoad == numClientsLocal && IDPrefer(a->ID(), mInstanceID);
+            return !(numClientsLocal < metadata.mLoad || prefer);
+        };
+        
+        const uint64_t resume = mResumeToken ? mResumeServer.load() : 0;
+        
+        // A server that we can resume with is tried first
+        // N.B. ties are ordered by one key (peers with IDs first by ID, then by name and port) so that this is a strict weak ordering
+        
+        auto rank = [resume](const typename PeerList::Peer *a, const typename PeerList::Peer *b)
+        {
+            if (resume && (a->ID() == resume) != (b->ID() == resume))
+                return a->ID() == resume;
+            
+            if (a->HasMetadata() != b->HasMetadata())
+                return a->HasMetadata();
+            
+            if (a->HasMetadata() && a->Metadata().mLoad != b->Metadata().mLoad)
+                return a->Metadata().mLoad > b->Metadata().mLoad;
+            
+            if (!a->ID() != !b->ID())
+                return a->ID() != 0;
+            
+            if (a->ID() != b->ID())
+                return IDPrefer(a->ID(), b->ID());
+            
+            if (strcmp(a->Name(), b->Name()))
+                return NamePrefer(a->Name(), b->Name());
+            
+            return a->Port() < b->Port();
+        };
+        
+        std::vector<const typename PeerList::Peer *> candidates;
+        
+        candidates.reserve(peers.size());
+        
+        for (auto it = peers.begin(); it != peers.end(); it++)
+        {
+            if (!rejects(&*it))
+                candidates.push_back(&*it);
         }
         
-        return false;
+        std::stable_sort(candidates.begin(), candidates.end(), rank);
+        
+        return candidates;
     }
     
-    void SendPeerList()
+    static std::string ServiceHost(const bonjour_service& service)
     {
-        PeerList::ListType peers;
-        mPeers.Get(peers);
+        // Make sure we conform the name correctly if the host is not resolved
 
-        // Don't send unresolved peers
+        if (!service.host().empty())
+            return service.host();
+        
+        std::string host = service.name();
+        std::string end("-local");
         
-        peers.remove_if([](const PeerList::Peer& a) { return a.IsUnresolved(); });
+        auto pos = host.length() - end.length();
         
-        if (peers.size())
+        if (host.length() >= end.length() && host.find(end, pos) != std::string::npos)
         {
-            NetworkByteChunk chunk(static_cast<int>(peers.size()));
-            
-            for (auto it = peers.begin(); it != peers.end(); it++)
-            {
-                chunk.Add(it->Name());
-                chunk.Add(it->Port());
-                chunk.Add(it->Time());
-            }
-            
-            SendConnectionDataFromServer("Peers", chunk);
+            host.resize(pos);
+            host.append(".local.");
         }
+        
+        return host;
     }
     
-    void PingClients()
+    void BrowseService(const bonjour_service& service)
     {
-        SendConnectionDataFromServer("Ping");
+        PeerSource source = service.host().empty() ? PeerSource::Unresolved : PeerSource::Discovered;
+        
+        mPeers.Browse({ServiceHost(service).c_str(), service.port(), source});
     }
     
-    void SetNextServer(const char* server, uint16_t port)
+    void UnbrowseService(const bonjour_service& service)
     {
-        // Prevent self connection
-        
-        if (!IsSelf(server))
-            mNextServer.Set(Host(server, port));
+        mPeers.Unbrowse({ServiceHost(service).c_str(), service.port(), PeerSource::Discovered});
     }
     
-    void HandleConnectionDataToServer(ConnectionID id, NetworkByteStream& stream)
+    // Beacon peers are connected to at the address their beacon came from (rather than by name)
+    // N.B. peers on this host are left to the registry (so that the two do not keep replacing each other's address)
+    
+    void BrowseService(const BeaconService& service)
     {
-        WDL_String clientName;
-        uint16_t port = 0;
-        
-        if (stream.IsNextTag("Negotiate"))
-        {
-            WDL_String hostName = GetHostName();
-            int numClients = 0;
-            int numClientsLocal = mConfirmedClients.Size();
-            
-            stream.Get(clientName);
-            stream.Get(port);
-            stream.Get(numClients);
-
-            bool prefer = numClients == numClientsLocal && NamePrefer(hostName.Get(), clientName.Get());
-            int confirm = numClients < numClientsLocal || prefer;
-            SendConnectionDataToClient(id, "Confirm", confirm);
-            
-            if (!confirm)
-                SetNextServer(clientName.Get(), port);
-        }
-        else if (stream.IsNextTag("Ping"))
-        {
-            stream.Get(clientName, port);
-            mPeers.Add({clientName, port, PeerSource::Client});
-        }
-        else if (stream.IsNextTag("Confirm"))
-        {
-            mConfirmedClients.Add(id);
-        }
+        if (!IsLocalPeer(service.InstanceID()))
+            mPeers.Browse({service.Host().c_str(), service.Port(), PeerSource::Discovered, service.InstanceID(), service.Metadata()});
     }
     
-    void HandleConnectionDataToClient(NetworkByteStream& stream)
+    void UnbrowseService(const BeaconService& service)
     {
-        WDL_String host;
-        uint16_t port = Port();
-        uint32_t time = 0;
-        int size = 0;
+        if (!IsLocalPeer(service.InstanceID()))
+            mPeers.Unbrowse({service.Host().c_str(), service.Port(), PeerSource::Discovered, service.InstanceID()});
+    }
+    
+    bool IsLocalPeer(uint64_t id) const
+    {
+        auto peers = mRegistry.Peers();
         
-        if (stream.IsNextTag("Confirm"))
-        {
-            int confirm = 0;
-            
-            stream.Get(confirm);
-            
-            mClientState = confirm ? ClientState::Confirmed : ClientState::Failed;
-        }
-        else if (stream.IsNextTag("Switch"))
-        {
-            stream.Get(host, port);
-            SetNextServer(host.Get(), port);
-        }
-        else if (stream.IsNextTag("Ping"))
-        {
-            host = GetHostName();
-            SendConnectionDataFromClient("Ping", host, port);
-        }
-        else if (stream.IsNextTag("Peers"))
-        {
-            stream.Get(size);
-            
-            for (int i = 0; i < size; i++)
-            {
-                stream.Get(host);
-                stream.Get(port);
-                stream.Get(time);
-
-                mPeers.Add({ host, port, PeerSource::Remote, time });
-            }
-        }
+        return std::any_of(peers->begin(), peers->end(), [&](const LocalService& a) { return a.InstanceID() == id; });
     }
     
-    void OnDataToServer(ConnectionID id, const iplug::IByteStream& data) final
+    // Peers on this host are connected to over loopback (which needs no name resolution)
+    
+    void BrowseService(const LocalService& service)
     {
-        NetworkByteStream stream(data);
-                
-        if (stream.IsNextTag(GetConnectionTag()))
-        {
-            HandleConnectionDataToServer(id, stream);
-        }
-        else if (stream.IsNextTag(GetDataTag()))
-        {
-            ReceiveAsServer(id, stream);
-        }
-        else
-        {
-            DBGMSG("Unknown network message to client\n");
-        }
+        mPeers.Browse({sLoopback, service.Port(), PeerSource::Discovered, service.InstanceID(), service.Metadata()});
     }
     
-    void OnDataToClient(const iplug::IByteStream& data) final
+    void UnbrowseService(const LocalService& service)
     {
-        NetworkByteStream stream(data);
-
-        if (stream.IsNextTag(GetConnectionTag()))
+        mPeers.Unbrowse({sLoopback, service.Port(), PeerSource::Discovered, service.InstanceID()});
+    }
+    
+    // Loopback addresses only make sense on this host (so our host name is sent to other peers in their place)
+    
+    WDL_String SharedName(const char* name) const
+    {
+        return LocalTransport::IsLoopback(name) ? GetHostName() : WDL_String(name);
+    }
+    
+    static bool NamePrefer(const char* name1, const char* name2)
+    {
+        return strcmp(name1, name2) < 0;
+    }
+    
+    static bool IDPrefer(uint64_t id1, uint64_t id2)
+    {
+        return id1 < id2;
+    }
+    
+    static uint64_t RandomID()
+    {
+        std::random_device device;
+        std::mt19937_64 generator((static_cast<uint64_t>(device()) << 32) ^ device());
+        
+        uint64_t id = 0;
+        
+        while (!id)
+            id = generator();
+        
+        return id;
+    }
+    
+    std::string MetricsInstance() const
+    {
+        char instance[20];
+        snprintf(instance, sizeof(instance), "%016llx", static_cast<unsigned long long>(mInstanceID));
+        
+        return instance;
+    }
+    
+    // The tags counted by name are the protocol's message names (connection messages from newer peers are counted as other)
+    
+    static std::vector<const char*> MetricsTags()
+    {
+        std::vector<const char*> tags;
+        
+        for (int i = 0; i < NetworkDictionary::NumShared(); i++)
         {
+            const char* name = NetworkDictionary::Shared(i);
+            
+            if (strcmp(name, GetConnectionTag()) && strcmp(name, GetDataTag()))
+                tags.push_back(name);
+        }
+        
+        return tags;
+    }
+    
+    // The port our own server listens on
+    
+    uint16_t ServerPort() const
+    {
+        return mRegistry.Port();
+    }
+    
+    bool IsSelf(const char* peerName, uint16_t port, uint64_t id) const
+    {
+        WDL_String host = GetHostName();
+        
+        if (id)
+            return id == mInstanceID;
+        
+        if (port != ServerPort())
+            return false;
+        
+        return !strcmp(host.Get(), peerName) || !strcmp(mHostName.Get(), peerName);
+    }
+        
+    // Wait briefly before stopping (so that final messages are sent) and then continue
+    // N.B. peers that run on an event loop override this to continue from a timer rather than blocking the loop
+    
+    virtual void WaitToStop(std::function<void()>&& then)
+    {
+        std::chrono::duration<double, std::milli> ms(500);
+        std::this_thread::sleep_for(ms);
+        then();
+    }
+    
+    constexpr static uint32_t GetProtocolVersion()
+    {
+        return 7;
+    }
+    
+    constexpr static uint32_t GetCapabilities()
+    {
+        return 0;
+    }
+    
+    constexpr static const char *GetConnectionTag()
+    {
+        return "~";
+    }
+    
+    constexpr static const char *GetDataTag()
+    {
+        return "-";
+    }
+    
+    // The metric for user data is its first element when that is a string (see AddMetricsTag())
+    
+    static const char* DataMetric() { return ""; }
+    static const char* MetricName(const char* str) { return str ? str : ""; }
+    static const char* MetricName(const WDL_String& str) { return str.Get(); }
+    
+    template <int N>
+    static const char* MetricName(const NetworkFixedString<N>& str) { return str.Get(); }
+    
+    template <class T>
+    static const char* MetricName(const T&) { return ""; }
+    
+    template <class First, class ...Args>
+    static const char* DataMetric(const First& first, const Args& ...)
+    {
+        return MetricName(first);
+    }
+    
+    // Connection messages are counted in the metrics by their name (and user data by its first element, see AddMetricsTag())
+    
+    template <class ...Args>
+    void SendConnectionDataToClient(ws_connection_id id, const char* name, const Args& ...args)
+    {
+        SendTaggedToClient(GetConnectionTag(), name, id, name, std::forward<const Args>(args)...);
+    }
+    
+    template <class ...Args>
+    void SendConnectionDataFromServer(const char* name, const Args& ...args)
+    {
+        SendTaggedFromServer(GetConnectionTag(), name, name, std::forward<const Args>(args)...);
+    }
+    
+    template <class ...Args>
+    void SendConnectionDataFromClient(const char* name, const Args& ...args)
+    {
+        SendTaggedFromClient(GetConnectionTag(), name, name, std::forward<const Args>(args)...);
+    }
+
+    // Strings sent to a single client (or from the client) are encoded with the connection's dictionary
+    
+    template <class ...Args>
+    void SendTaggedToClient(const char *tag, const char* metric, ws_connection_id id, const Args& ...args)
+    {
+        if (size_t size = SendEncodedToClient(id, tag, std::forward<const Args>(args)...))
+            Sent(NetworkMetrics::Key(id), metric, size);
+    }
+    
+    template <class ...Args>
+    void SendTaggedFromServer(const char *tag, const char* metric, const Args& ...args)
+    {
+        NetworkByteChunk chunk(tag, std::forward<const Args>(args)...);
+        
+        if (SendDataFromServer(chunk))
+            Sent(NetworkMetrics::sBroadcastConnection, metric, chunk.Size());
+    }
+    
+    template <class ...Args>
+    void SendTaggedFromClient(const char *tag, const char* metric, const Args& ...args)
+    {
+        if (size_t size = SendEncodedFromClient(tag, std::forward<const Args>(args)...))
+            Sent(NetworkMetrics::sServerConnection, metric, size);
+    }
+    
+    // Traffic is counted in the metrics and traced (when tracing is enabled)
+    
+    void Sent(uint64_t connection, const char* metric, size_t size)
+    {
+        mMetrics.Sent(connection, metric, size);
+        NetworkTrace::Instant("message", "send", mInstanceID, connection, metric);
+    }
+    
+    void Received(uint64_t connection, const char* metric, size_t size)
+    {
+        mMetrics.Received(connection, metric, size);
+        NetworkTrace::Instant("message", "receive", mInstanceID, connection, metric);
+    }
+    
+    void OnServerReady(ConnectionID id) override
+    {
+        mMetrics.Open(NetworkMetrics::Key(id));
+        NetworkTrace::Instant("connection", "accept", mInstanceID, NetworkMetrics::Key(id));
+    }
+    
+    void OnServerDisconnect(ConnectionID id) override
+    {
+        typename ClientList::Client client;
+        
+        NetworkTrace::Instant("connection", "close", mInstanceID, NetworkMetrics::Key(id));
+        mMetrics.Release(NetworkMetrics::Key(id));
+        
+        if (mConfirmedClients.Find(id, client))
+            mResumeTokens.Closed(id, client);
+        
+        mConfirmedClients.Remove(id);
+    }
+    
+    void OnCloseClient() override
+    {
+        NetworkTrace::Instant("connection", "disconnect", mInstanceID, mServerID.load());
+    }
+    
+    // Records are keyed by the server port (which identifies the registry slot) and are not kept without a user directory
+    
+    static WDL_String DefaultLastServerPath(const char* regname, uint16_t port)
+    {
+        const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+        const char* home = std::getenv("HOME");
+        
+        WDL_String path;
+        
+        if (runtime && *runtime)
+            path.Set(runtime);
+        else if (home && *home)
+            path.Set(home);
+        else
+            return path;
+        
+        if (path.Get()[path.GetLength() - 1] != '/')
+            path.Append("/");
+        
+        path.AppendFormatted(256, ".%s-%u.lastserver", regname, static_cast<unsigned int>(port));
+        
+        return path;
+    }
+    
+    void LoadLastServer()
+    {
+        if (!mLastServerPath.GetLength())
+            return;
+        
+        if (FILE* file = fopen(mLastServerPath.Get(), "r"))
+        {
+            char host[256];
+            unsigned int port = 0;
+            
+            if (fscanf(file, "%255s %u", host, &port) == 2 && port && port <= UINT16_MAX && !IsSelf(host, static_cast<uint16_t>(port), 0))
+                mLastServer.Set(Host(host, static_cast<uint16_t>(port)));
+            
+            fclose(file);
+        }
+    }
+    
+    // N.B. this is called from the discovery pass (so that file writes are kept off the network threads)
+    
+    void StoreLastServer()
+    {
+        Host server = mConfirmedServer.Take();
+        
+        if (server.Empty() || !mLastServerPath.GetLength())
+            return;
+        
+        if (FILE* file = fopen(mLastServerPath.Get(), "w"))
+        {
+            fprintf(file, "%s %u\n", server.Name(), static_cast<unsigned int>(server.Port()));
+            fclose(file);
+        }
+    }
+    
+    // Joining completes as soon as the server replies (clients confirmed by the server do not announce themselves)
+    // N.B. stopping our own server waits (for our clients to switch) so it is left to the next discovery pass
+    
+    void ClientConnectionConfirmed(bool announce = true)
+    {
+        WDL_String server = Client::GetServerName();
+        WDL_String host = GetHostName();
+        
+        if (announce)
+            SendConnectionDataFromClient("Confirm", mInstanceID, host, ServerPort());
+        
+        SendConnectionDataFromServer("Switch", SharedName(server.Get()), Port(), mServerID.load());
+        mConfirmedServer.Set(Host(server.Get(), Port()));
+        
+        mClientState = ClientState::Connected;
+        mStopServing = true;
+    }
+    
+    void StopServing()
+    {
+        if (!mStopServing.exchange(false))
+            return;
+        
+        WaitToStop([this]()
+        {
+            StopDiscovery();
+            StopServer();
+            mConfirmedClients.Clear();
+            mResumeTokens.Clear();
+        });
+    }
+    
+    bool TryConnect(const Host& server, bool direct = false)
+    {
+        bool connected = Connect(server.Name(), server.Port());
+        
+        NetworkTrace::Instant("connection", connected ? "connect" : "connect failed", mInstanceID, server.ID(), server.Name());
+        
+        if (connected)
+        {
+            mServerID = server.ID();
+            
+            if (!direct)
+            {
+                mClientState = ClientState::Unconfirmed;
+                WDL_String host = GetHostName();
+                uint16_t port = ServerPort();
+            
+                // A server that issued us a token is asked to resume (which negotiates if the token is no longer valid)
+                
+                if (mResumeToken && server.ID() && server.ID() == mResumeServer)
+                    SendConnectionDataFromClient("Resume", mResumeToken.load(), mInstanceID, host, port, mConfirmedClients.Size());
+                else
+                    SendConnectionDataFromClient("Negotiate", mInstanceID, host, port, mConfirmedClients.Size());
+            }
+            else
+            {
+                ClientConnectionConfirmed();
+                StopServing();
+            }
+            
+            return true;
+        }
+        
+        return false;
+    }
+    
+    // Host details are only sent when the membership changes (or a client joins)
+    // Otherwise peers are refreshed by instance ID alone
+    
+    void SendPeerList()
+    {
+        auto peers = mPeers.Get();
+
+        // Don't send unresolved peers (or peers without an ID when refreshing by ID)
+        
+        auto resolved = [](const typename PeerList::Peer& a) { return !a.IsUnresolved(); };
+        auto identified = [](const typename PeerList::Peer& a) { return !a.IsUnresolved() && a.ID(); };
+        
+        uint64_t version = mPeers.Version();
+        
+        if (mHostsDirty.exchange(false) || version != mHostsVersion)
+        {
+            mHostsVersion = version;
+            
+            NetworkByteChunk chunk(static_cast<int>(std::count_if(peers->begin(), peers->end(), resolved)));
+            
+            for (auto it = peers->begin(); it != peers->end(); it++)
+            {
+                if (resolved(*it))
+                    chunk.Add(it->ID(), SharedName(it->Name()).Get(), it->Port(), it->Time());
+            }
+            
+            SendConnectionDataFromServer("Hosts", chunk);
+        }
+        else if (int size = static_cast<int>(std::count_if(peers->begin(), peers->end(), identified)))
+        {
+            NetworkByteChunk chunk(size);
+            
+            for (auto it = peers->begin(); it != peers->end(); it++)
+            {
+                if (identified(*it))
+                    chunk.Add(it->ID(), it->Time());
+            }
+            
+            SendConnectionDataFromServer("Peers", chunk);
+        }
+    }
+    
+    bool IsFull(int joining) const
+    {
+        const int max = mMaxClients;
+        
+        return max && mConfirmedClients.Size() + joining > max;
+    }
+    
+    // Redirects name the least loaded server we know of that has room for the client (or no server if there is none)
+    // N.B. other servers are assumed to share our limit (load is only known for peers with discovery metadata)
+    
+    void Redirect(ConnectionID id, uint64_t clientID, int joining)
+    {
+        auto peers = mPeers.Get();
+        const typename PeerList::Peer *best = nullptr;
+        const uint32_t max = static_cast<uint32_t>(mMaxClients.load());
+        
+        for (auto it = peers->begin(); it != peers->end(); it++)
+        {
+            if (!it->HasMetadata() || it->IsClient() || it->IsUnresolved() || it->ID() == clientID || IsSelf(it->Name(), it->Port(), it->ID()))
+                continue;
+            
+            const BeaconMetadata& metadata = it->Metadata();
+            
+            if (metadata.mProtocolVersion != GetProtocolVersion() || metadata.mLoad + joining > max || mFullServers.Contains(it->ID()))
+                continue;
+            
+            if (!best || metadata.mLoad < best->Metadata().mLoad)
+                best = &*it;
+        }
+        
+        Host target = best ? best->GetHost() : Host();
+        
+        NetworkTrace::Instant("connection", "redirect", mInstanceID, NetworkMetrics::Key(id), target.Name());
+        SendConnectionDataToClient(id, "Redirect", mInstanceID, SharedName(target.Name()).Get(), target.Port(), target.ID());
+    }
+    
+    // Pings carry the server's time so that the echo from each client gives its round trip time
+    
+    void PingClients()
+    {
+        SendConnectionDataFromServer("Ping", PingTime());
+    }
+    
+    static uint64_t PingTime()
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+    }
+    
+    // The host's load average as a percentage of its hardware threads (zero if unavailable)
+    
+    static uint32_t HostLoad()
+    {
+        double load = 0.0;
+        double threads = std::max(1U, std::thread::hardware_concurrency());
+        
+        if (getloadavg(&load, 1) != 1)
+            return 0;
+        
+        return static_cast<uint32_t>(std::min(1000.0, 100.0 * load / threads));
+    }
+    
+    // Clients probe their round trips to the other peers directly and report them (and we probe our clients likewise)
+    // A client is chosen when its mean round trip to the others (including us) beats ours by both margins
+    // N.B. the choice must hold for several passes (busy hosts are never chosen) and a new server holds off electing
+    
+    void ConsiderHandover()
+    {
+        auto clients = mConfirmedClients.Get();
+        auto links = mLatencyProbe.Get();
+        
+        const typename ClientList::Client *best = nullptr;
+        double serverMean = 0.0;
+        double bestMean = 0.0;
+        double rtt = 0.0;
+        
+        const double sinceHandover = (PingTime() - mHandoverTime) / 1000000.0;
+        
+        if (!mLatencyElection || clients->size() < 2 || sinceHandover < sHandoverHoldOff)
+        {
+            mHandoverPasses = 0;
+            return;
+        }
+        
+        for (auto it = clients->begin(); it != clients->end(); it++)
+        {
+            if (it->second.mSamples < sHandoverMinSamples || !LinkTime(links, mInstanceID, it->second, rtt))
+            {
+                mHandoverPasses = 0;
+                return;
+            }
+            
+            serverMean += rtt;
+        }
+        
+        const double n = static_cast<double>(clients->size());
+        
+        serverMean /= n;
+        
+        // Candidates without a measurement to every other peer are not considered
+        
+        for (auto it = clients->begin(); it != clients->end(); it++)
+        {
+            const typename ClientList::Client& candidate = it->second;
+            
+            bool measured = candidate.mLoad < sHandoverMaxLoad && LinkTime(links, mInstanceID, candidate, rtt);
+            double sum = rtt;
+            
+            for (auto jt = clients->begin(); measured && jt != clients->end(); jt++)
+            {
+                if (jt != it && (measured = LinkTime(candidate.mLinks, candidate.mHost.ID(), jt->second, rtt)))
+                    sum += rtt;
+            }
+            
+            if (measured && (!best || sum / n < bestMean))
+            {
+                best = &candidate;
+                bestMean = sum / n;
+            }
+        }
+        
+        if (!best || bestMean > serverMean * (1.0 - sHandoverMargin) || serverMean - bestMean < sHandoverMinGain)
+        {
+            mHandoverPasses = 0;
+            return;
+        }
+        
+        // The same candidate must be preferred on consecutive passes
+        
+        if (best->mHost.ID() != mHandoverCandidate)
+        {
+            mHandoverCandidate = best->mHost.ID();
+            mHandoverPasses = 0;
+        }
+        
+        if (++mHandoverPasses >= sHandoverPasses)
+        {
+            mHandoverPasses = 0;
+            Handover(best->mHost);
+        }
+    }
+    
+    // The round trip between a peer and a client as measured by either (averaged if both have measured it)
+    
+    static bool LinkTime(const LatencyProbe::Links& links, uint64_t id, const typename ClientList::Client& client, double& rtt)
+    {
+        double forward = 0.0;
+        double reverse = 0.0;
+        
+        bool hasForward = LatencyProbe::Find(links, client.mHost.ID(), forward);
+        bool hasReverse = LatencyProbe::Find(client.mLinks, id, reverse);
+        
+        if (hasForward && hasReverse)
+            rtt = (forward + reverse) * 0.5;
+        else if (hasForward || hasReverse)
+            rtt = hasForward ? forward : reverse;
+        
+        return hasForward || hasReverse;
+    }
+    
+    // Probes to our clients (for the latency election)
+    
+    void ProbeClients()
+    {
+        if (!mLatencyElection)
+            return;
+        
+        auto clients = mConfirmedClients.Get();
+        
+        for (auto it = clients->begin(); it != clients->end(); it++)
+            mLatencyProbe.Probe(it->second.mHost.Name(), it->second.mHost.Port(), it->second.mHost.ID());
+    }
+    
+    // Clients probe the other peers they know of and report the round trips measured so far to the server
+    
+    void ReportLinks()
+    {
+        if (!mLatencyElection)
+            return;
+        
+        auto peers = mPeers.Get();
+        auto links = mLatencyProbe.Get();
+        
+        for (auto it = peers->begin(); it != peers->end(); it++)
+        {
+            if (!it->IsUnresolved() && it->ID() && !IsSelf(it->Name(), it->Port(), it->ID()))
+                mLatencyProbe.Probe(it->Name(), it->Port(), it->ID());
+        }
+        
+        int size = std::min(static_cast<int>(links.size()), sMaxLinks);
+        NetworkByteChunk chunk(mInstanceID, size);
+        
+        for (int i = 0; i < size; i++)
+            chunk.Add(links[i].first, links[i].second);
+        
+        SendConnectionDataFromClient("Links", chunk);
+    }
+    
+    // The chosen client starts serving when it sees itself named and the rest (including us) join it directly
+    
+    void Handover(const Host& host)
+    {
+        NetworkTrace::Instant("connection", "handover", mInstanceID, host.ID(), host.Name());
+        
+        mHandoverTime = PingTime();
+        SendConnectionDataFromServer("Switch", host.Name(), host.Port(), host.ID());
+        SetNextServer(host.Name(), host.Port(), host.ID());
+        
+        WaitToStop([this]()
+        {
+            StopServer();
+            mConfirmedClients.Clear();
+            mResumeTokens.Clear();
+        });
+    }
+    
+    void SetNextServer(const char* server, uint16_t port, uint64_t id)
+    {
+        // Prevent self connection
+        
+        if (!IsSelf(server, port, id))
+            mNextServer.Set(Host(server, port, id));
+    }
+    
+    void HandleConnectionDataToServer(ConnectionID id, NetworkByteStream& stream)
+    {
+        NetworkName clientName;
+        uint16_t port = 0;
+        uint64_t clientID = 0;
+        
+        if (stream.IsNextTag("Negotiate"))
+        {
+            int numClients = 0;
+            
+            stream.Get(clientID, clientName, port, numClients);
+            Negotiate(id, clientID, clientName, port, numClients);
+        }
+        else if (stream.IsNextTag("Resume"))
+        {
+            typename ClientList::Client client;
+            uint64_t token = 0;
+            int numClients = 0;
+            
+            stream.Get(token, clientID, clientName, port, numClients);
+            
+            // A valid token restores the client's confirmed state (and link measurements) with a new token
+            // N.B. we negotiate instead whilst also connecting as a client (so that the pair cannot both become clients)
+            // or if the client now has more clients than we do (so that the larger group is kept)
+            
+            bool elect = IsClientConnected() || numClients > mConfirmedClients.Size();
+            
+            if (!elect && !IsFull(numClients + 1) && mResumeTokens.Redeem(token, clientID, client))
+            {
+                client.mHost = Host(clientName, port, clientID);
+                SendConnectionDataToClient(id, "Resumed", mInstanceID, ConfirmClient(id, client));
+            }
+            else
+                Negotiate(id, clientID, clientName, port, numClients);
+        }
+        else if (stream.IsNextTag("Ping"))
+        {
+            Host client;
+            uint64_t time = 0;
+            uint32_t load = 0;
+            
+            stream.Get(clientID, time, load);
+            
+            if (mConfirmedClients.Identity(id, client) && client.ID() == clientID)
+            {
+                mPeers.Add({client.Name(), client.Port(), PeerSource::Client, clientID});
+                mConfirmedClients.UpdateLink(id, (PingTime() - time) / 1000.0, load);
+            }
+        }
+        else if (stream.IsNextTag("Links"))
+        {
+            Host client;
+            LatencyProbe::Links links;
+            int size = 0;
+            
+            stream.Get(clientID, size);
+            
+            for (int i = 0; i < size && i < sMaxLinks; i++)
+            {
+                uint64_t peerID = 0;
+                double rtt = 0.0;
+                
+                stream.Get(peerID, rtt);
+                
+                if (stream.Tell() < 0)
+                    break;
+                
+                links.emplace_back(peerID, rtt);
+            }
+            
+            if (mConfirmedClients.Identity(id, client) && client.ID() == clientID)
+                mConfirmedClients.UpdateLinks(id, links);
+        }
+        else if (stream.IsNextTag("Confirm"))
+        {
+            Host client;
+            
+            stream.Get(clientID, clientName, port);
+            
+            // Clients that connect directly (without negotiating) are also subject to the limit
+            
+            if (!mConfirmedClients.Identity(id, client) && IsFull(1))
+            {
+                Redirect(id, clientID, 1);
+                return;
+            }
+            
+            SendConnectionDataToClient(id, "Token", mInstanceID, ConfirmClient(id, { Host(clientName, port, clientID) }));
+        }
+    }
+    
+    void Negotiate(ConnectionID id, uint64_t clientID, const NetworkName& clientName, uint16_t port, int numClients)
+    {
+        int numClientsLocal = mConfirmedClients.Size();
+        
+        // The client brings its own clients (which follow it here)
+        
+        if (IsFull(numClients + 1))
+        {
+            Redirect(id, clientID, numClients + 1);
+            return;
+        }
+        
+        // A peer that has joined another server declines (as its own server is about to stop)
+        // N.B. a peer still negotiating as a client elects as usual (so that two peers joining each other agree)
+        
+        bool leaving = mStopServing || (IsClientConnected() && mClientState == ClientState::Connected);
+        bool prefer = numClients == numClientsLocal && IDPrefer(mInstanceID, clientID);
+        int confirm = !leaving && (numClients < numClientsLocal || prefer);
+        
+        // A confirmed client is added straight away (so the reply completes the join)
+        
+        uint64_t token = confirm ? ConfirmClient(id, { Host(clientName, port, clientID) }) : 0;
+        SendConnectionDataToClient(id, "Confirm", confirm, mInstanceID, token);
+        
+        if (!confirm && !leaving)
+            SetNextServer(clientName.Get(), port, clientID);
+    }
+    
+    // Confirmed clients are issued a resumption token
+    
+    uint64_t ConfirmClient(ConnectionID id, const typename ClientList::Client& client)
+    {
+        const Host& host = client.mHost;
+        
+        mConfirmedClients.Add(id, client);
+        mMetrics.Label(NetworkMetrics::Key(id), (std::string(host.Name()) + ":" + std::to_string(host.Port())).c_str());
+        mPeers.Add({host.Name(), host.Port(), PeerSource::Client, host.ID()});
+        mHostsDirty = true;
+        
+        return mResumeTokens.Issue(id, client);
+    }
+    
+    // The server has already added us (N.B. replayed messages do not join as there is no connection)
+    
+    void Joined(uint64_t serverID, uint64_t token)
+    {
+        mResumeServer = serverID;
+        mResumeToken = token;
+        
+        if (IsClientConnected() && mClientState == ClientState::Unconfirmed)
+            ClientConnectionConfirmed(false);
+    }
+    
+    void HandleConnectionDataToClient(NetworkByteStream& stream)
+    {
+        NetworkName host;
+        uint16_t port = Port();
+        uint64_t id = 0;
+        uint32_t time = 0;
+        int size = 0;
+        
+        if (stream.IsNextTag("Confirm"))
+        {
+            uint64_t token = 0;
+            int confirm = 0;
+            
+            stream.Get(confirm, id, token);
+            
+            mServerID = id;
+            
+            if (confirm)
+                Joined(id, token);
+            else
+                mClientState = ClientState::Failed;
+        }
+        else if (stream.IsNextTag("Token"))
+        {
+            uint64_t token = 0;
+            
+            stream.Get(id, token);
+            
+            mResumeServer = id;
+            mResumeToken = token;
+        }
+        else if (stream.IsNextTag("Resumed"))
+        {
+            uint64_t token = 0;
+            
+            // The server restored our confirmed state (so there is nothing further to negotiate)
+            
+            stream.Get(id, token);
+            
+            mServerID = id;
+            Joined(id, token);
+        }
+        else if (stream.IsNextTag("Redirect"))
+        {
+            uint64_t serverID = 0;
+            
+            // The server is full so avoid it for a while and move on (to the suggested server if there is one)
+            
+            stream.Get(serverID, host, port, id);
+            mFullServers.Add(serverID);
+            
+            if (host.GetLength())
+                SetNextServer(host.Get(), port, id);
+            
+            mClientState = ClientState::Failed;
+        }
+        else if (stream.IsNextTag("Switch"))
+        {
+            stream.Get(host, port, id);
+            
+            // Being named is a handover (so serve straight away for the others to join)
+            
+            if (IsSelf(host.Get(), port, id))
+            {
+                mHandoverTime = PingTime();
+                StartServer(ServerPort());
+            }
+            else
+                SetNextServer(host.Get(), port, id);
+        }
+        else if (stream.IsNextTag("Ping"))
+        {
+            uint64_t time = 0;
+            
+            stream.Get(time);
+            SendConnectionDataFromClient("Ping", mInstanceID, time, HostLoad());
+        }
+        else if (stream.IsNextTag("Hosts"))
+        {
+            typename PeerList::ListType peers;
+            
+            stream.Get(size);
+            
+            for (int i = 0; i < size; i++)
+            {
+                stream.Get(id, host, port, time);
+                
+                if (stream.Tell() < 0)
+                    break;
+                
+                peers.emplace_back(host, port, PeerSource::Remote, id, time);
+            }
+            
+            mPeers.Add(peers);
+        }
+        else if (stream.IsNextTag("Peers"))
+        {
+            std::vector<std::pair<uint64_t, uint32_t>> times;
+            
+            stream.Get(size);
+            
+            for (int i = 0; i < size; i++)
+            {
+                stream.Get(id, time);
+                
+                if (stream.Tell() < 0)
+                    break;
+                
+                times.emplace_back(id, time);
+            }
+            
+            mPeers.Refresh(times);
+        }
+    }
+    
+    void OnDataToServer(ConnectionID id, const iplug::IByteStream& data) final
+    {
+        NetworkByteStream stream(data, 0, Server::ServerDecoder(id));
+        char name[32];
+        
+        // Definitions are read whether or not the handler reads the strings that use them
+        
+        stream.ReadDefinitions();
+        
+        if (stream.IsNextTag(GetConnectionTag()))
+        {
+            stream.PeekStr(name, sizeof(name));
+            Received(NetworkMetrics::Key(id), name, data.Size());
+            NetworkTrace::Scope trace("handler", "connection", mInstanceID, NetworkMetrics::Key(id), name);
+            HandleConnectionDataToServer(id, stream);
+        }
+        else if (stream.IsNextTag(GetDataTag()))
+        {
+            stream.PeekStr(name, sizeof(name));
+            Received(NetworkMetrics::Key(id), name, data.Size());
+            NetworkTrace::Scope trace("handler", "data", mInstanceID, NetworkMetrics::Key(id));
+            ReceiveAsServer(id, stream);
+        }
+        else
+        {
+            DBGMSG("Unknown network message to client\n");
+        }
+    }
+    
+    void OnDataToClient(const iplug::IByteStream& data) final
+    {
+        NetworkByteStream stream(data, 0, Client::ClientDecoder());
+        char name[32];
+        
+        stream.ReadDefinitions();
+
+        if (stream.IsNextTag(GetConnectionTag()))
+        {
+            stream.PeekStr(name, sizeof(name));
+            Received(NetworkMetrics::sServerConnection, name, data.Size());
+            NetworkTrace::Scope trace("handler", "connection", mInstanceID, NetworkMetrics::sServerConnection, name);
             HandleConnectionDataToClient(stream);
         }
         else if (stream.IsNextTag(GetDataTag()))
         {
+            stream.PeekStr(name, sizeof(name));
+            Received(NetworkMetrics::sServerConnection, name, data.Size());
+            NetworkTrace::Scope trace("handler", "data", mInstanceID, NetworkMetrics::sServerConnection);
             ReceiveAsClient(stream);
         }
         else
@@ -774,17 +2262,69 @@ private:
     // Tracking the client connection process
     
     std::atomic<ClientState> mClientState;
+    std::atomic<uint64_t> mServerID;
+    std::atomic<bool> mStopServing;
     
     // Info about other peers
     
     ClientList mConfirmedClients;
     PeerList mPeers;
     NextServer mNextServer;
+    FullServers mFullServers;
+    
+    // Resumption (tokens issued as a server and the token held as a client)
+    
+    ResumeTokens mResumeTokens;
+    std::atomic<uint64_t> mResumeToken { 0 };
+    std::atomic<uint64_t> mResumeServer { 0 };
+    
+    std::atomic<int> mMaxClients { 0 };
+    
+    std::atomic<bool> mHostsDirty { false };
+    uint64_t mHostsVersion = 0;
+    
+    // Latency election (the margins are relative and in milliseconds and the hold-off is in seconds)
+    
+    static constexpr int sHandoverMinSamples = 4;
+    static constexpr int sHandoverPasses = 5;
+    static constexpr double sHandoverMargin = 0.25;
+    static constexpr double sHandoverMinGain = 5.0;
+    static constexpr uint32_t sHandoverMaxLoad = 75;
+    static constexpr double sHandoverHoldOff = 60.0;
+    static constexpr int sMaxLinks = 64;
+    
+    std::atomic<bool> mLatencyElection { true };
+    std::atomic<uint64_t> mHandoverTime { 0 };
+    uint64_t mHandoverCandidate = 0;
+    int mHandoverPasses = 0;
 
-    // Bonjour
+    // Discovery
     
-    CPUTimer mBonjourRestart;
-    DiscoverablePeer mDiscoverable;
+    static constexpr double sDiscoveryInitialBackoff = 15.0;
+    static constexpr double sDiscoveryMaxBackoff = 240.0;
+    static constexpr const char *sLoopback = "127.0.0.1";
+
+    CPUTimer mDiscoveryIdle;
+    double mDiscoveryBackoff = sDiscoveryInitialBackoff;
+    
+    const DiscoveryMode mDiscoveryMode;
+    const WDL_String mHostName;
+    const uint64_t mInstanceID;
+    LocalRegistry mRegistry;
+    std::shared_ptr<NetworkHub> mHub;
+    LatencyProbe mLatencyProbe;
+    
+    // Traffic metrics
+    
+    NetworkMetrics mMetrics;
+    
+    // Fast start (the server to try first and a newly confirmed server to record)
+    
+    WDL_String mLastServerPath;
+    NextServer mLastServer { std::numeric_limits<double>::infinity() };
+    NextServer mConfirmedServer { std::numeric_limits<double>::infinity() };
 };
 
+using NetworkPeer = NetworkPeerInterface<>;
+
 #endif /* NETWORKPEER_HPP */
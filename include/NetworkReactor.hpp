@@ -0,0 +1,295 @@
+
+#ifndef NETWORKREACTOR_HPP
+#define NETWORKREACTOR_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "NetworkPeer.hpp"
+#include "NetworkTiming.hpp"
+
+// Types for peers whose transport events, timers and sends are all processed on a single reactor thread
+// The locks compile to nothing and transport events are deferred to Dispatch() (which posts them to the reactor)
+
+struct NetworkReactorTypes
+{
+protected:
+    
+    static constexpr bool sDeferEvents = true;
+    
+    using ConnectionID = ws_connection_id;
+    
+    struct RecursiveMutex {};
+    struct SharedMutex {};
+    
+    struct RecursiveLock
+    {
+        RecursiveLock(RecursiveMutex* mutex) {}
+    };
+    
+    struct SharedLock
+    {
+        SharedLock(SharedMutex* mutex) {}
+    };
+    
+    struct ExclusiveLock
+    {
+        ExclusiveLock(SharedMutex* mutex) {}
+    };
+    
+    struct VariableLock
+    {
+        VariableLock(SharedMutex* mutex, bool shared = true) {}
+        
+        void Destroy() {}
+        void Promote() {}
+        void Demote() {}
+        
+        VariableLock(VariableLock const& rhs) = delete;
+        void operator = (VariableLock const& rhs) = delete;
+    };
+};
+
+// A single-threaded event loop with per-owner events and repeating timers
+// Events may be posted from any thread, but all run on the thread that calls Run()
+// N.B. the queue mutex is only held to hand events over (never whilst an event runs)
+
+class NetworkReactor
+{
+    using Lock = std::unique_lock<std::mutex>;
+    
+public:
+    
+    using Event = std::function<void()>;
+    
+    NetworkReactor()
+    : mRunning(nullptr)
+    , mStopping(false)
+    , mNextTimer(0)
+    {}
+    
+    NetworkReactor(const NetworkReactor&) = delete;
+    NetworkReactor& operator=(const NetworkReactor&) = delete;
+    
+    void Post(const void* owner, Event event)
+    {
+        Lock lock(mMutex);
+        
+        mEvents.emplace_back(owner, std::move(event));
+        mCondition.notify_all();
+    }
+    
+    // Timers fire immediately and then at the given interval (until cancelled)
+    
+    uint64_t Every(const void* owner, double intervalMS, Event event)
+    {
+        Lock lock(mMutex);
+        
+        mTimers.push_back({ owner, ++mNextTimer, IntervalPoll(intervalMS), std::move(event), true });
+        mCondition.notify_all();
+        
+        return mNextTimer;
+    }
+    
+    // One-shot timers fire once after the given delay (unless cancelled)
+    
+    uint64_t After(const void* owner, double delayMS, Event event)
+    {
+        Lock lock(mMutex);
+        
+        mTimers.push_back({ owner, ++mNextTimer, IntervalPoll(delayMS), std::move(event), false });
+        mTimers.back().mPoll();
+        mCondition.notify_all();
+        
+        return mNextTimer;
+    }
+    
+    void CancelTimer(uint64_t id)
+    {
+        Lock lock(mMutex);
+        
+        mTimers.remove_if([&](const Timer& a) { return a.mID == id; });
+    }
+    
+    // Remove all events and timers for an owner and wait for any that is running on another thread
+    
+    void Cancel(const void* owner)
+    {
+        Lock lock(mMutex);
+        
+        mEvents.erase(std::remove_if(mEvents.begin(), mEvents.end(), [&](const Posted& a) { return a.first == owner; }), mEvents.end());
+        mTimers.remove_if([&](const Timer& a) { return a.mOwner == owner; });
+        
+        if (std::this_thread::get_id() != mThread)
+            mCondition.wait(lock, [&]() { return mRunning != owner; });
+    }
+    
+    // Run events until Stop() is called (timers are serviced before queued events)
+    
+    void Run()
+    {
+        Lock lock(mMutex);
+        
+        mThread = std::this_thread::get_id();
+        
+        while (!mStopping)
+        {
+            double wait = sMaxWaitMS;
+            
+            auto due = std::find_if(mTimers.begin(), mTimers.end(), [&](Timer& a)
+            {
+                wait = std::min(wait, a.mPoll.Until());
+                return a.mPoll();
+            });
+            
+            // N.B. the timer event is copied as the timer may be cancelled whilst it runs (and one-shot timers are removed first)
+            
+            if (due != mTimers.end())
+            {
+                Posted posted(due->mOwner, due->mEvent);
+                
+                if (!due->mRepeat)
+                    mTimers.erase(due);
+                
+                Execute(lock, posted);
+            }
+            else if (!mEvents.empty())
+            {
+                Posted posted = std::move(mEvents.front());
+                mEvents.pop_front();
+                Execute(lock, posted);
+            }
+            else
+                mCondition.wait_for(lock, std::chrono::duration<double, std::milli>(wait));
+        }
+        
+        mStopping = false;
+        mThread = std::thread::id();
+    }
+    
+    void Stop()
+    {
+        Lock lock(mMutex);
+        
+        mStopping = true;
+        mCondition.notify_all();
+    }
+    
+    bool IsReactorThread() const
+    {
+        Lock lock(mMutex);
+        
+        return std::this_thread::get_id() == mThread;
+    }
+    
+private:
+    
+    static constexpr double sMaxWaitMS = 100.0;
+    
+    using Posted = std::pair<const void *, Event>;
+    
+    struct Timer
+    {
+        const void *mOwner;
+        uint64_t mID;
+        IntervalPoll mPoll;
+        Event mEvent;
+        bool mRepeat;
+    };
+    
+    void Execute(Lock& lock, Posted& posted)
+    {
+        mRunning = posted.first;
+        lock.unlock();
+        posted.second();
+        lock.lock();
+        mRunning = nullptr;
+        mCondition.notify_all();
+    }
+    
+    mutable std::mutex mMutex;
+    std::condition_variable mCondition;
+    
+    std::deque<Posted> mEvents;
+    std::list<Timer> mTimers;
+    
+    const void *mRunning;
+    bool mStopping;
+    uint64_t mNextTimer;
+    std::thread::id mThread;
+};
+
+// A peer that runs entirely on a reactor thread (with no internal locking)
+// Transport events and hub discovery events are posted to the reactor and discovery is driven by a reactor timer
+// N.B. all other methods (including sends) must be called on the reactor thread (e.g. through Post())
+// N.B. peers should be destroyed on the reactor thread or after it has stopped
+
+class ReactorPeer : public NetworkPeerInterface<NetworkReactorTypes>
+{
+public:
+    
+    ReactorPeer(NetworkReactor& reactor, const char *regname, uint16_t port = 8001, DiscoveryMode mode = DiscoveryMode::Bonjour)
+    : NetworkPeerInterface(regname, port, mode)
+    , mReactor(reactor)
+    , mDiscoveryTimer(0)
+    {}
+    
+    // Everything that can post events for this peer is stopped before its events are cancelled
+    
+    ~ReactorPeer()
+    {
+        StopReactorDiscovery();
+        StopEventSources();
+        mReactor.Cancel(this);
+    }
+    
+    void Post(NetworkReactor::Event event)
+    {
+        mReactor.Post(this, std::move(event));
+    }
+    
+    void StartReactorDiscovery(double interval = 1500, double maxPeerTime = 30000)
+    {
+        StopReactorDiscovery();
+        
+        auto discover = [this, interval, maxPeerTime]() { Discover(interval, maxPeerTime); };
+        
+        mDiscoveryTimer = mReactor.Every(this, interval, discover);
+    }
+    
+    void StopReactorDiscovery()
+    {
+        if (mDiscoveryTimer)
+            mReactor.CancelTimer(mDiscoveryTimer);
+        
+        mDiscoveryTimer = 0;
+    }
+    
+    NetworkReactor& Reactor() const { return mReactor; }
+    
+private:
+    
+    void Dispatch(std::function<void()>&& event) override
+    {
+        mReactor.Post(this, std::move(event));
+    }
+    
+    void WaitToStop(std::function<void()>&& then) override
+    {
+        mReactor.After(this, sStopDelayMS, std::move(then));
+    }
+    
+    static constexpr double sStopDelayMS = 500.0;
+    
+    NetworkReactor& mReactor;
+    uint64_t mDiscoveryTimer;
+};
+
+#endif /* NETWORKREACTOR_HPP */
@@ -2,22 +2,42 @@
 #ifndef NETWORKSERVER_HPP
 #define NETWORKSERVER_HPP
 
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "IPlugLogger.h"
 #include "IPlugStructs.h"
 
+#include "LocalTransport.hpp"
+#include "NetworkCapture.hpp"
+#include "NetworkData.hpp"
 #include "NetworkTypes.hpp"
 
 // A generic web socket network server that requires an interface for the specifics of the networking
+// Same-host clients may also connect through a local transport that runs alongside the websocket server
+// The lock types (and whether transport events are deferred to Dispatch()) are taken from the Types policy
 
-template <class T>
-class NetworkServerInterface : protected NetworkTypes
+template <class T, class Types = NetworkTypes>
+class NetworkServerInterface : protected Types
 {
+protected:
+    
+    using typename Types::ConnectionID;
+    using typename Types::RecursiveMutex;
+    using typename Types::RecursiveLock;
+    using typename Types::SharedMutex;
+    using typename Types::SharedLock;
+    using typename Types::VariableLock;
+    
 public:
     
-    NetworkServerInterface() : mServer(nullptr)  {}
+    NetworkServerInterface() : mServer(nullptr), mLocalServer(nullptr), mRunning(false), mCapture(nullptr)  {}
     virtual ~NetworkServerInterface() {}
     
     NetworkServerInterface(const NetworkServerInterface&) = delete;
@@ -40,10 +60,22 @@ public:
                                                              DoCloseServer
                                                             };
             
+            static constexpr LocalServer::Handlers localHandlers = { DoConnectServer,
+                                                                     DoReadyServer,
+                                                                     DoDataServer,
+                                                                     DoCloseServer
+                                                                    };
+            
             auto server = T::create(port, "/ws", ws_server_owner<handlers>{ this });
             
+            // N.B. the local server is only started once the websocket server owns the port
+            
+            auto localServer = server ? LocalServer::Create(static_cast<uint16_t>(atoi(port)), localHandlers, this) : nullptr;
+            
             lock.Promote();
             mServer = server;
+            mLocalServer = localServer;
+            mRunning = server != nullptr;
             
             DBGMSG("SERVER: Websocket server running on port %s\n", port);
         }
@@ -59,7 +91,10 @@ public:
         {
             lock.Promote();
             std::unique_ptr<T> release(mServer);
+            std::unique_ptr<LocalServer> releaseLocal(mLocalServer);
+            mRunning = false;
             mServer = nullptr;
+            mLocalServer = nullptr;
             lock.Destroy();
             DBGMSG("SERVER: Destroyed\n");
         }
@@ -69,13 +104,21 @@ public:
     {
         SharedLock lock(&mMutex);
         
-        return mServer ? static_cast<int>(mServer->size()) : 0;
+        size_t size = mLocalServer ? mLocalServer->Size() : 0;
+        
+        return mServer ? static_cast<int>(mServer->size() + size) : 0;
     }
     
     bool SendDataToClient(ws_connection_id id, const iplug::IByteChunk& chunk)
     {
         SharedLock lock(&mMutex);
         
+        if (mLocalServer && mLocalServer->Has(id))
+        {
+            mLocalServer->Send(id, chunk.GetData(), chunk.Size());
+            return true;
+        }
+        
         if (mServer)
         {
             mServer->send(id, chunk.GetData(), chunk.Size());
@@ -92,12 +135,39 @@ public:
         if (mServer)
         {
             mServer->send(chunk.GetData(), chunk.Size());
+            
+            if (mLocalServer)
+                mLocalServer->Send(chunk.GetData(), chunk.Size());
+            
             return true;
         }
         
         return false;
     }
     
+    // Send a message with its strings encoded by the client's dictionary (returning its size or zero on failure)
+    // N.B. the dictionary is locked until the message is sent so that definitions always precede their use
+    // Messages to all clients only use the shared entries (as clients join at different times)
+    
+    template <class ...Args>
+    size_t SendEncodedToClient(ws_connection_id id, const Args& ...args)
+    {
+        SharedLock lock(&mMutex);
+        
+        if (!mServer)
+            return 0;
+        
+        auto dictionary = FindDictionary(id);
+        
+        if (!dictionary)
+            return 0;
+        
+        RecursiveLock encoderLock(&dictionary->mMutex);
+        NetworkByteChunk chunk(dictionary->mEncoder, args...);
+        
+        return SendDataToClient(id, chunk) ? chunk.Size() : 0;
+    }
+    
     bool IsServerConnected() const
     {
         SharedLock lock(&mMutex);
@@ -112,29 +182,105 @@ public:
         return mServer;
     }
     
+    // Inbound events are written to the capture whilst one is set (the capture must outlive the server or be unset)
+    
+    void SetServerCapture(NetworkCapture* capture)
+    {
+        mCapture = capture;
+    }
+    
+    // Pass a captured event directly to the handlers (returning false if it is refused)
+    // N.B. events are refused whilst the server is running (as replies to replayed connections would reach the transport)
+    
+    bool ReplayServerEvent(NetworkCapture::Kind kind, ConnectionID id, const void* pData, size_t size)
+    {
+        SharedLock lock(&mMutex);
+        
+        if (mServer || mLocalServer)
+            return false;
+        
+        switch (kind)
+        {
+            case NetworkCapture::Kind::ServerReady:
+                ResetDictionary(id);
+                OnServerReady(id);
+                break;
+                
+            case NetworkCapture::Kind::ServerData:
+            {
+                iplug::IByteStream stream(pData, static_cast<int>(size));
+                OnDataToServer(id, stream);
+                break;
+            }
+                
+            case NetworkCapture::Kind::ServerClose:
+                OnServerDisconnect(id);
+                RemoveDictionary(id);
+                break;
+                
+            default:
+                break;
+        }
+        
+        return true;
+    }
+    
+protected:
+    
+    // The dictionary decoder for a client (only for use whilst handling its data)
+    
+    NetworkDictionary::Decoder* ServerDecoder(ConnectionID id)
+    {
+        auto dictionary = FindDictionary(id);
+        
+        return dictionary ? &dictionary->mDecoder : nullptr;
+    }
+    
 private:
     
+    // The string dictionaries for each client (which last until the client disconnects)
+    
+    struct Dictionary
+    {
+        RecursiveMutex mMutex;
+        NetworkDictionary::Encoder mEncoder;
+        NetworkDictionary::Decoder mDecoder;
+    };
+    
     // Customisable Handlers
     
     virtual void OnServerReady(ConnectionID id) {}
     virtual void OnServerDisconnect(ConnectionID id) {}
     virtual void OnDataToServer(ConnectionID id, const iplug::IByteStream& data) = 0;
     
+    // Deferred transport events are passed here (to be run later on a thread of the owner's choosing)
+    
+    virtual void Dispatch(std::function<void()>&& event) { event(); }
+    
     // Handlers
+    // N.B. deferred events may run after the server has stopped (so each checks that it is still running)
     
     void HandleSocketConnection(ConnectionID id)
     {
         SharedLock lock(&mMutex);
         
+        if (!mServer)
+            return;
+        
         DBGMSG("SERVER: Connected\n");
     }
     
     void HandleSocketReady(ConnectionID id)
     {
         SharedLock lock(&mMutex);
-                
+        
+        if (!mServer)
+            return;
+        
         DBGMSG("SERVER: New connection - num clients %i\n", NClients());
         
+        Capture(NetworkCapture::Kind::ServerReady, id);
+        ResetDictionary(id);
         OnServerReady(id);
     }
     
@@ -144,6 +290,7 @@ private:
                 
         if (mServer)
         {
+            Capture(NetworkCapture::Kind::ServerData, id, pData, size);
             iplug::IByteStream stream(pData, static_cast<int>(size));
             OnDataToServer(id, stream);
         }
@@ -152,10 +299,15 @@ private:
     void HandleSocketClose(ConnectionID id)
     {
         SharedLock lock(&mMutex);
-                
+        
+        if (!mServer)
+            return;
+        
         DBGMSG("SERVER: Closed connection - num clients %i\n", NClients());
         
+        Capture(NetworkCapture::Kind::ServerClose, id);
         OnServerDisconnect(id);
+        RemoveDictionary(id);
     }
     
     // Static Handlers
@@ -167,7 +319,7 @@ private:
         // N.B. Return values are 0 for success and 1 for close
         
         if (pServer)
-            pServer->HandleSocketConnection(id);
+            pServer->HandleEvent([pServer, id]() { pServer->HandleSocketConnection(id); });
     }
     
     static void DoReadyServer(ConnectionID id, void *pUntypedServer)
@@ -175,7 +327,7 @@ private:
         auto pServer = AsServer(pUntypedServer);
 
         if (pServer)
-            pServer->HandleSocketReady(id);
+            pServer->HandleEvent([pServer, id]() { pServer->HandleSocketReady(id); });
     }
     
     static void DoDataServer(ConnectionID id, const void* pData, size_t size, void *pUntypedServer)
@@ -183,7 +335,19 @@ private:
         auto pServer = AsServer(pUntypedServer);
 
         if (pServer)
-            pServer->HandleSocketData(id, pData, size);
+        {
+            // Deferred data must be copied as the transport owns the buffer only for this call
+            
+            if (Types::sDeferEvents)
+            {
+                auto pBytes = static_cast<const uint8_t *>(pData);
+                std::vector<uint8_t> data(pBytes, pBytes + size);
+                
+                pServer->Dispatch([pServer, id, data]() { pServer->HandleSocketData(id, data.data(), data.size()); });
+            }
+            else
+                pServer->HandleSocketData(id, pData, size);
+        }
     }
     
     static void DoCloseServer(ConnectionID id, void *pUntypedServer)
@@ -191,7 +355,48 @@ private:
         auto pServer = AsServer(pUntypedServer);
         
         if (pServer)
-            pServer->HandleSocketClose(id);
+            pServer->HandleEvent([pServer, id]() { pServer->HandleSocketClose(id); });
+    }
+    
+    template <class Event>
+    void HandleEvent(Event&& event)
+    {
+        if (Types::sDeferEvents)
+            Dispatch(std::forward<Event>(event));
+        else
+            event();
+    }
+    
+    void Capture(NetworkCapture::Kind kind, ConnectionID id, const void* pData = nullptr, size_t size = 0)
+    {
+        if (NetworkCapture* capture = mCapture)
+            capture->Server(kind, id, pData, size);
+    }
+    
+    // Dictionaries are shared so that a send can complete whilst its client disconnects
+    // N.B. they are only created when a client is ready (so a send racing a close cannot recreate one)
+    
+    std::shared_ptr<Dictionary> FindDictionary(ConnectionID id)
+    {
+        RecursiveLock lock(&mDictionaryMutex);
+        
+        auto it = mDictionaries.find(id);
+        
+        return it != mDictionaries.end() ? it->second : nullptr;
+    }
+    
+    void ResetDictionary(ConnectionID id)
+    {
+        RecursiveLock lock(&mDictionaryMutex);
+        
+        mDictionaries[id] = std::make_shared<Dictionary>();
+    }
+    
+    void RemoveDictionary(ConnectionID id)
+    {
+        RecursiveLock lock(&mDictionaryMutex);
+        
+        mDictionaries.erase(id);
     }
     
     static NetworkServerInterface* AsServer(void *pUntypedServer)
@@ -199,14 +404,20 @@ private:
         auto pServer = reinterpret_cast<NetworkServerInterface *>(pUntypedServer);
         
         // This may occur when a request hits the server before the context is saved
+        // N.B. this runs on the transport thread so it reads the running flag (rather than the server pointer)
         
-        if (pServer->mServer == nullptr)
+        if (!pServer->mRunning)
             return nullptr;
         
         return pServer;
     }
     
     T *mServer;
+    LocalServer *mLocalServer;
+    std::atomic<bool> mRunning;
+    std::atomic<NetworkCapture *> mCapture;
+    RecursiveMutex mDictionaryMutex;
+    std::unordered_map<ConnectionID, std::shared_ptr<Dictionary>> mDictionaries;
 
 protected:
     
@@ -216,9 +427,11 @@ protected:
 // Concrete implementations based on the platform
 
 #ifdef __APPLE__
-using NetworkServer = NetworkServerInterface<nw_ws_server>;
+using NetworkServerTransport = nw_ws_server;
 #else
-using NetworkServer = NetworkServerInterface<cw_ws_server>;
+using NetworkServerTransport = cw_ws_server;
 #endif
 
+using NetworkServer = NetworkServerInterface<NetworkServerTransport>;
+
 #endif /* NETWORKSERVER_HPP */
@@ -0,0 +1,357 @@
+
+#ifndef NETWORKTRACE_HPP
+#define NETWORKTRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Optional tracing of peer activity (messages, connections, handlers and discovery) for viewing as a timeline
+// Events are written to a ring buffer per thread without locking and exported as Chrome trace JSON
+// When tracing is disabled each trace point costs a single relaxed load
+// Recording pauses whilst buffers are exported or cleared (so that no event is read whilst it is being written)
+// N.B. times are from the system clock (in microseconds) so that exports from several processes can be merged
+
+class NetworkTrace
+{
+    static constexpr int sBufferSize = 16384;
+    static constexpr int sMaxDetail = 32;
+    
+public:
+    
+    // Enabling
+    
+    static void Enable(bool enable)
+    {
+        Enabled().store(enable, std::memory_order_relaxed);
+    }
+    
+    static bool IsEnabled()
+    {
+        return Enabled().load(std::memory_order_relaxed);
+    }
+    
+    // Events (the category and name must be string literals, but the detail is copied)
+    
+    static void Instant(const char* category, const char* name, uint64_t peer, uint64_t arg = 0, const char* detail = nullptr)
+    {
+        if (IsEnabled())
+            Record('i', category, name, peer, arg, detail);
+    }
+    
+    static void Begin(const char* category, const char* name, uint64_t peer, uint64_t arg = 0, const char* detail = nullptr)
+    {
+        if (IsEnabled())
+            Record('B', category, name, peer, arg, detail);
+    }
+    
+    static void End(const char* category, const char* name, uint64_t peer, uint64_t arg = 0, const char* detail = nullptr)
+    {
+        if (IsEnabled())
+            Record('E', category, name, peer, arg, detail);
+    }
+    
+    // A scoped begin / end pair (the end is only recorded if the begin was)
+    
+    class Scope
+    {
+    public:
+        
+        Scope(const char* category, const char* name, uint64_t peer, uint64_t arg = 0, const char* detail = nullptr)
+        : mCategory(category)
+        , mName(name)
+        , mPeer(peer)
+        , mArg(arg)
+        , mDetail(detail)
+        , mActive(IsEnabled())
+        {
+            if (mActive)
+                Record('B', mCategory, mName, mPeer, mArg, mDetail);
+        }
+        
+        ~Scope()
+        {
+            if (mActive)
+                Record('E', mCategory, mName, mPeer, mArg, mDetail);
+        }
+        
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        
+    private:
+        
+        const char *mCategory;
+        const char *mName;
+        uint64_t mPeer;
+        uint64_t mArg;
+        const char *mDetail;
+        bool mActive;
+    };
+    
+    // Export all buffered events as Chrome trace JSON (each peer is shown as a process and each thread as a thread)
+    // N.B. events that would be recorded whilst the buffers are copied are dropped
+    
+    static std::string Export()
+    {
+        std::vector<std::pair<int, Event>> events;
+        std::unordered_map<uint64_t, int> peers;
+        std::string json("{\"traceEvents\":[\n");
+        char line[512];
+        
+        {
+            Pause pause;
+            
+            for (auto it = Registry().mBuffers.begin(); it != Registry().mBuffers.end(); it++)
+                (*it)->Read(events);
+        }
+        
+        std::stable_sort(events.begin(), events.end(), [](const std::pair<int, Event>& a, const std::pair<int, Event>& b) { return a.second.mTime < b.second.mTime; });
+        
+        for (auto it = events.begin(); it != events.end(); it++)
+        {
+            const Event& event = it->second;
+            auto peer = peers.find(event.mPeer);
+            
+            // Name each peer when it is first seen
+            
+            if (peer == peers.end())
+            {
+                peer = peers.emplace(event.mPeer, static_cast<int>(peers.size()) + 1).first;
+                snprintf(line, sizeof(line), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"peer %016llx\"}},\n",
+                         peer->second, static_cast<unsigned long long>(event.mPeer));
+                json += line;
+            }
+            
+            snprintf(line, sizeof(line), "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%d,%s\"args\":{\"arg\":\"%016llx\",\"detail\":\"",
+                     event.mName, event.mCategory, event.mPhase, static_cast<unsigned long long>(event.mTime), peer->second, it->first,
+                     event.mPhase == 'i' ? "\"s\":\"t\"," : "", static_cast<unsigned long long>(event.mArg));
+            json += line;
+            Escape(json, event.mDetail);
+            json += "\"}},\n";
+        }
+        
+        // A final metadata event avoids a trailing comma
+        
+        json += "{\"name\":\"trace_end\",\"ph\":\"M\",\"pid\":0,\"args\":{}}\n]}\n";
+        
+        return json;
+    }
+    
+    static bool Write(const char* path)
+    {
+        std::string json = Export();
+        
+        FILE* file = fopen(path, "w");
+        
+        if (!file)
+            return false;
+        
+        bool written = fwrite(json.data(), 1, json.size(), file) == json.size();
+        
+        return !fclose(file) && written;
+    }
+    
+    static void Clear()
+    {
+        Pause pause;
+        
+        for (auto it = Registry().mBuffers.begin(); it != Registry().mBuffers.end(); it++)
+            (*it)->mCount.store(0, std::memory_order_release);
+    }
+    
+private:
+    
+    struct Event
+    {
+        uint64_t mTime;
+        uint64_t mPeer;
+        uint64_t mArg;
+        const char *mCategory;
+        const char *mName;
+        char mPhase;
+        char mDetail[sMaxDetail];
+    };
+    
+    // A ring buffer written only by its owning thread (and reused once that thread exits)
+    
+    struct Buffer
+    {
+        Buffer(int index) : mIndex(index), mCount(0), mInUse(true), mRecording(false) {}
+        
+        void Write(const Event& event)
+        {
+            uint64_t count = mCount.load(std::memory_order_relaxed);
+            
+            mEvents[count % sBufferSize] = event;
+            mCount.store(count + 1, std::memory_order_release);
+        }
+        
+        void Read(std::vector<std::pair<int, Event>>& events) const
+        {
+            uint64_t count = mCount.load(std::memory_order_acquire);
+            uint64_t first = count > sBufferSize ? count - sBufferSize : 0;
+            
+            for (uint64_t i = first; i < count; i++)
+                events.emplace_back(mIndex, mEvents[i % sBufferSize]);
+        }
+        
+        const int mIndex;
+        std::atomic<uint64_t> mCount;
+        std::atomic<bool> mInUse;
+        std::atomic<bool> mRecording;
+        Event mEvents[sBufferSize];
+    };
+    
+    struct Buffers
+    {
+        std::mutex mMutex;
+        std::list<std::unique_ptr<Buffer>> mBuffers;
+        std::atomic<int> mPaused { 0 };
+    };
+    
+    // Holds the registry and waits for any event being recorded to finish (later events are dropped until released)
+    // N.B. a recording thread marks its buffer before checking for a pause and this pauses before checking the marks
+    // (both sequentially consistent) so that either the thread sees the pause or this sees the mark
+    
+    class Pause
+    {
+    public:
+        
+        Pause() : mLock(Registry().mMutex)
+        {
+            Registry().mPaused.fetch_add(1);
+            
+            for (auto it = Registry().mBuffers.begin(); it != Registry().mBuffers.end(); it++)
+            {
+                while ((*it)->mRecording.load())
+                    std::this_thread::yield();
+            }
+        }
+        
+        ~Pause()
+        {
+            Registry().mPaused.fetch_sub(1);
+        }
+        
+        Pause(const Pause&) = delete;
+        Pause& operator=(const Pause&) = delete;
+        
+    private:
+        
+        std::lock_guard<std::mutex> mLock;
+    };
+    
+    // Each thread holds a buffer from the registry (which is only locked to acquire or release it)
+    
+    class ThreadBuffer
+    {
+    public:
+        
+        ThreadBuffer()
+        {
+            std::lock_guard<std::mutex> lock(Registry().mMutex);
+            
+            auto& buffers = Registry().mBuffers;
+            auto it = std::find_if(buffers.begin(), buffers.end(), [](const std::unique_ptr<Buffer>& a) { return !a->mInUse.load(); });
+            
+            if (it != buffers.end())
+            {
+                mBuffer = it->get();
+                mBuffer->mInUse = true;
+            }
+            else
+            {
+                buffers.emplace_back(new Buffer(static_cast<int>(buffers.size()) + 1));
+                mBuffer = buffers.back().get();
+            }
+        }
+        
+        ~ThreadBuffer()
+        {
+            mBuffer->mInUse = false;
+        }
+        
+        Buffer& Get() { return *mBuffer; }
+        
+    private:
+        
+        Buffer *mBuffer;
+    };
+    
+    static void Record(char phase, const char* category, const char* name, uint64_t peer, uint64_t arg, const char* detail)
+    {
+        static thread_local ThreadBuffer buffer;
+        
+        Event event;
+        
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        
+        event.mTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+        event.mPeer = peer;
+        event.mArg = arg;
+        event.mCategory = category;
+        event.mName = name;
+        event.mPhase = phase;
+        event.mDetail[0] = 0;
+        
+        if (detail)
+        {
+            strncpy(event.mDetail, detail, sMaxDetail - 1);
+            event.mDetail[sMaxDetail - 1] = 0;
+        }
+        
+        Buffer& target = buffer.Get();
+        
+        target.mRecording.store(true);
+        
+        if (!Registry().mPaused.load())
+            target.Write(event);
+        
+        target.mRecording.store(false, std::memory_order_release);
+    }
+    
+    static void Escape(std::string& json, const char* str)
+    {
+        char escaped[8];
+        
+        for (; *str; str++)
+        {
+            if (*str == '"' || *str == '\\')
+            {
+                json += '\\';
+                json += *str;
+            }
+            else if (static_cast<unsigned char>(*str) < 0x20)
+            {
+                snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned int>(*str));
+                json += escaped;
+            }
+            else
+                json += *str;
+        }
+    }
+    
+    static std::atomic<bool>& Enabled()
+    {
+        static std::atomic<bool> enabled(false);
+        return enabled;
+    }
+    
+    static Buffers& Registry()
+    {
+        static Buffers buffers;
+        return buffers;
+    }
+};
+
+#endif /* NETWORKTRACE_HPP */
@@ -6,32 +6,61 @@
 
 #include <mutex>
 
+// Defining NETWORK_LOCK_INSTRUMENTATION records contention statistics for every lock site (see LockStats)
+
+#ifdef NETWORK_LOCK_INSTRUMENTATION
+#include "LockInstrumentation.hpp"
+#define NETWORK_LOCK_SITE , const char* file = __builtin_FILE(), int line = __builtin_LINE()
+#define NETWORK_LOCK_TIMING(method) mTiming.method()
+#else
+#define NETWORK_LOCK_SITE
+#define NETWORK_LOCK_TIMING(method)
+#endif
+
 struct NetworkTypes
 {
 protected:
     
+    // Transport events are handled on the transport threads (rather than passed to Dispatch())
+    
+    static constexpr bool sDeferEvents = false;
+    
     using ConnectionID = ws_connection_id;
 
     using RecursiveMutex = WDL_Mutex;
-    using RecursiveLock = WDL_MutexLock;
     using SharedMutex = WDL_SharedMutex;
+    
+#ifdef NETWORK_LOCK_INSTRUMENTATION
+    using RecursiveLock = InstrumentedRecursiveLock;
+    using SharedLock = InstrumentedSharedLock;
+    using ExclusiveLock = InstrumentedExclusiveLock;
+#else
+    using RecursiveLock = WDL_MutexLock;
     using SharedLock = WDL_MutexLockShared;
     using ExclusiveLock = WDL_MutexLockExclusive;
+#endif
     
     class VariableLock
     {
     public:
         
-        VariableLock(SharedMutex* mutex, bool shared = true)
+        VariableLock(SharedMutex* mutex, bool shared = true NETWORK_LOCK_SITE)
         : mMutex(mutex)
         , mShared(shared)
+#ifdef NETWORK_LOCK_INSTRUMENTATION
+        , mTiming(file, line, "variable")
+#endif
         {
             if (mMutex)
             {
+                NETWORK_LOCK_TIMING(Acquire);
+                
                 if (shared)
                     mMutex->LockShared();
                 else
                     mMutex->LockExclusive();
+                
+                NETWORK_LOCK_TIMING(Acquired);
             }
         }
         
@@ -44,6 +73,8 @@ protected:
         {
             if (mMutex)
             {
+                NETWORK_LOCK_TIMING(Released);
+                
                 if (mShared)
                     mMutex->UnlockShared();
                 else
@@ -57,7 +88,9 @@ protected:
         {
             if (mMutex && mShared)
             {
+                NETWORK_LOCK_TIMING(Acquire);
                 mMutex->SharedToExclusive();
+                NETWORK_LOCK_TIMING(Promoted);
                 mShared = false;
             }
         }
@@ -80,6 +113,9 @@ protected:
         
         SharedMutex *mMutex;
         bool mShared;
+#ifdef NETWORK_LOCK_INSTRUMENTATION
+        LockTiming mTiming;
+#endif
     };
 };
 
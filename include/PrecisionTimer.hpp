@@ -65,8 +65,8 @@ class PrecisionTimer : public NetworkPeer
     
 public:
     
-    PrecisionTimer(const char *regname, uint16_t port = 8001)
-    : NetworkPeer(regname, port)
+    PrecisionTimer(const char *regname, uint16_t port = 8001, DiscoveryMode mode = DiscoveryMode::Bonjour)
+    : NetworkPeer(regname, port, mode)
     , mLastTimeStamp(0)
     {}
     